@@ -8,6 +8,8 @@
 
 #if _WIN32
 #include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "win32dirent.h"
 #else // _WIN32
 #include <sys/types.h>
@@ -164,6 +166,108 @@ static bool filepath_is_readable(const path_t& path)
     return true;
 }
 
+// size in bytes and modification time in seconds, false when the file does not exist
+static bool get_file_stat(const path_t& path, long long* size, long long* mtime)
+{
+#if _WIN32
+    struct _stat64 st;
+    if (_wstat64(path.c_str(), &st) != 0)
+        return false;
+#else // _WIN32
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#endif // _WIN32
+
+    *size = (long long)st.st_size;
+    *mtime = (long long)st.st_mtime;
+    return true;
+}
+
+static void remove_file(const path_t& path)
+{
+#if _WIN32
+    _wremove(path.c_str());
+#else // _WIN32
+    remove(path.c_str());
+#endif // _WIN32
+}
+
+static int get_process_id()
+{
+#if _WIN32
+    return (int)GetCurrentProcessId();
+#else // _WIN32
+    return (int)getpid();
+#endif // _WIN32
+}
+
+// move src over dst, atomic where the filesystem allows
+static bool replace_file(const path_t& src, const path_t& dst)
+{
+#if _WIN32
+    return MoveFileExW(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else // _WIN32
+    return rename(src.c_str(), dst.c_str()) == 0;
+#endif // _WIN32
+}
+
+// copy through a temporary file next to dst, so that dst is never seen half written
+// writers racing for the same dst pass distinct tmpsuffix and the last rename wins
+static bool copy_file(const path_t& src, const path_t& dst, const path_t& tmpsuffix = PATHSTR(".tmp"))
+{
+    const path_t tmppath = dst + tmpsuffix;
+
+#if _WIN32
+    FILE* fp = _wfopen(src.c_str(), L"rb");
+#else // _WIN32
+    FILE* fp = fopen(src.c_str(), "rb");
+#endif // _WIN32
+    if (!fp)
+        return false;
+
+#if _WIN32
+    FILE* outfp = _wfopen(tmppath.c_str(), L"wb");
+#else // _WIN32
+    FILE* outfp = fopen(tmppath.c_str(), "wb");
+#endif // _WIN32
+    if (!outfp)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    bool success = true;
+
+    std::vector<char> buffer(1024 * 1024);
+    for (;;)
+    {
+        size_t n = fread(buffer.data(), 1, buffer.size(), fp);
+        if (n == 0)
+            break;
+
+        if (fwrite(buffer.data(), 1, n, outfp) != n)
+        {
+            success = false;
+            break;
+        }
+    }
+
+    success = success && !ferror(fp);
+
+    fclose(fp);
+    success = fclose(outfp) == 0 && success;
+
+    success = success && replace_file(tmppath, dst);
+
+    if (!success)
+    {
+        remove_file(tmppath);
+    }
+
+    return success;
+}
+
 static path_t sanitize_filepath(const path_t& path)
 {
     if (filepath_is_readable(path))
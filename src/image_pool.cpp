@@ -0,0 +1,199 @@
+// waifu2x implemented with ncnn library
+
+#include "image_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if __linux__
+#include <sys/mman.h>
+#endif // __linux__
+
+// transparent huge page size on x86 and most arm kernels
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// the ncnn allocator pads for simd loads past the end, do the same
+static const size_t OVERREAD_SIZE = 64;
+
+ImagePool::ImagePool()
+{
+    capacity = 0;
+    huge_pages = false;
+    free_size = 0;
+    hits = 0;
+    misses = 0;
+}
+
+ImagePool::~ImagePool()
+{
+    clear();
+
+    // buffers still handed out are leaked rather than freed under their users
+    if (!used_buffers.empty())
+    {
+        fprintf(stderr, "ImagePool %d buffers still in use\n", (int)used_buffers.size());
+    }
+}
+
+void ImagePool::set_capacity(size_t _capacity)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    capacity = _capacity;
+}
+
+void ImagePool::set_huge_pages(bool _huge_pages)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    // buffers are released the way they were allocated, so only before the first one
+    if (used_buffers.empty() && free_buffers.empty())
+        huge_pages = _huge_pages;
+}
+
+void* ImagePool::fastMalloc(size_t size)
+{
+    const size_t class_size = size_class(size);
+
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        std::multimap<size_t, void*>::iterator it = free_buffers.find(class_size);
+        if (it != free_buffers.end())
+        {
+            void* ptr = it->second;
+            free_buffers.erase(it);
+            free_size -= class_size;
+
+            used_buffers[ptr] = class_size;
+            hits++;
+            return ptr;
+        }
+
+        misses++;
+    }
+
+    // page in outside the lock
+    void* ptr = allocate(class_size);
+    if (!ptr)
+        return 0;
+
+    ncnn::MutexLockGuard guard(lock);
+    used_buffers[ptr] = class_size;
+
+    return ptr;
+}
+
+void ImagePool::fastFree(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    ncnn::MutexLockGuard guard(lock);
+
+    std::map<void*, size_t>::iterator it = used_buffers.find(ptr);
+    if (it == used_buffers.end())
+    {
+        fprintf(stderr, "ImagePool %p not allocated here\n", ptr);
+        return;
+    }
+
+    const size_t class_size = it->second;
+    used_buffers.erase(it);
+
+    if (class_size > capacity)
+    {
+        deallocate(ptr, class_size);
+        return;
+    }
+
+    // inputs come largest first, so the largest free buffers are the least likely to be asked for again
+    while (free_size + class_size > capacity)
+    {
+        std::multimap<size_t, void*>::iterator largest = --free_buffers.end();
+        deallocate(largest->second, largest->first);
+        free_size -= largest->first;
+        free_buffers.erase(largest);
+    }
+
+    free_buffers.insert(std::make_pair(class_size, ptr));
+    free_size += class_size;
+}
+
+void ImagePool::clear()
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    std::multimap<size_t, void*>::iterator it = free_buffers.begin();
+    for (; it != free_buffers.end(); it++)
+    {
+        deallocate(it->second, it->first);
+    }
+
+    free_buffers.clear();
+    free_size = 0;
+}
+
+size_t ImagePool::hit_count() const
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    return hits;
+}
+
+size_t ImagePool::miss_count() const
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    return misses;
+}
+
+size_t ImagePool::size_class(size_t size)
+{
+    if (size <= 4096)
+        return 4096;
+
+    size_t power = 4096;
+    while (power <= size / 2)
+    {
+        power *= 2;
+    }
+
+    const size_t step = power / 8;
+    return (size + step - 1) / step * step;
+}
+
+void* ImagePool::allocate(size_t size) const
+{
+#if __linux__
+    if (huge_pages && size >= HUGE_PAGE_SIZE)
+    {
+        const size_t huge_size = (size + OVERREAD_SIZE + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        void* ptr = 0;
+        if (posix_memalign(&ptr, HUGE_PAGE_SIZE, huge_size) != 0)
+            return 0;
+
+        // a hint only, kernels without thp or with it disabled keep small pages
+        madvise(ptr, huge_size, MADV_HUGEPAGE);
+        return ptr;
+    }
+#endif // __linux__
+
+    return ncnn::fastMalloc(size + OVERREAD_SIZE);
+}
+
+void ImagePool::deallocate(void* ptr, size_t size) const
+{
+#if __linux__
+    if (huge_pages && size >= HUGE_PAGE_SIZE)
+    {
+        free(ptr);
+        return;
+    }
+#else // __linux__
+    (void)size;
+#endif // __linux__
+
+    ncnn::fastFree(ptr);
+}
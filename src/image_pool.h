@@ -0,0 +1,58 @@
+// waifu2x implemented with ncnn library
+
+#ifndef IMAGE_POOL_H
+#define IMAGE_POOL_H
+
+#include <stddef.h>
+#include <map>
+
+// ncnn
+#include "allocator.h"
+#include "platform.h"
+
+// size classed free lists of decoded and upscaled image buffers, shared by the load proc and save threads
+// a returned buffer serves the next image of about the same size without page faults and kernel zeroing
+class ImagePool : public ncnn::Allocator
+{
+public:
+    ImagePool();
+    virtual ~ImagePool();
+
+    // bytes of free buffers kept for reuse, the rest go back to the system
+    void set_capacity(size_t capacity);
+
+    // back large buffers with transparent huge pages where the system has them
+    void set_huge_pages(bool huge_pages);
+
+    virtual void* fastMalloc(size_t size);
+    virtual void fastFree(void* ptr);
+
+    // release all free buffers
+    void clear();
+
+    size_t hit_count() const;
+    size_t miss_count() const;
+
+private:
+    // sizes round up to 1/8 steps between powers of two, at most 12.5% of a buffer is slack
+    static size_t size_class(size_t size);
+
+    void* allocate(size_t size) const;
+    void deallocate(void* ptr, size_t size) const;
+
+private:
+    size_t capacity;
+    bool huge_pages;
+
+    // free buffers by class size, and the class size of every buffer handed out
+    std::multimap<size_t, void*> free_buffers;
+    std::map<void*, size_t> used_buffers;
+    size_t free_size;
+
+    size_t hits;
+    size_t misses;
+
+    mutable ncnn::Mutex lock;
+};
+
+#endif // IMAGE_POOL_H
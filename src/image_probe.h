@@ -0,0 +1,145 @@
+// waifu2x implemented with ncnn library
+
+#ifndef IMAGE_PROBE_H
+#define IMAGE_PROBE_H
+
+// image dimensions from the file header without decoding pixels
+#include <stdio.h>
+#include <string.h>
+
+static int probe_be16(const unsigned char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static int probe_be32(const unsigned char* p)
+{
+    return (int)(((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3]);
+}
+
+static int probe_le24(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static int png_probe(const unsigned char* header, int len, int* w, int* h, int* c)
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    // signature, IHDR length and type, width, height, bit depth, color type
+    if (len < 26 || memcmp(header, signature, 8) != 0 || memcmp(header + 12, "IHDR", 4) != 0)
+        return 0;
+
+    *w = probe_be32(header + 16);
+    *h = probe_be32(header + 20);
+
+    // gray alpha and rgba, a tRNS chunk may still add alpha to the others
+    const int color_type = header[25];
+    *c = (color_type == 4 || color_type == 6) ? 4 : 3;
+
+    return 1;
+}
+
+static int webp_probe(const unsigned char* header, int len, int* w, int* h, int* c)
+{
+    if (len < 30 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WEBP", 4) != 0)
+        return 0;
+
+    const unsigned char* chunk = header + 12;
+
+    if (memcmp(chunk, "VP8 ", 4) == 0)
+    {
+        // lossy, frame tag then start code then 14bit width and height
+        *w = (chunk[14] | (chunk[15] << 8)) & 0x3fff;
+        *h = (chunk[16] | (chunk[17] << 8)) & 0x3fff;
+        *c = 3;
+        return 1;
+    }
+
+    if (memcmp(chunk, "VP8L", 4) == 0)
+    {
+        // lossless, signature byte then 14bit width - 1, 14bit height - 1 and the alpha hint
+        const unsigned char* p = chunk + 9;
+        const unsigned int bits = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+        *w = (int)(bits & 0x3fff) + 1;
+        *h = (int)((bits >> 14) & 0x3fff) + 1;
+        *c = (bits >> 28) & 1 ? 4 : 3;
+        return 1;
+    }
+
+    if (memcmp(chunk, "VP8X", 4) == 0)
+    {
+        // extended, flags then 24bit canvas width - 1 and height - 1
+        *w = probe_le24(chunk + 12) + 1;
+        *h = probe_le24(chunk + 15) + 1;
+        *c = chunk[8] & 0x10 ? 4 : 3;
+        return 1;
+    }
+
+    return 0;
+}
+
+// walk the marker segments up to the frame header, which may sit behind a large exif block
+static int jpeg_probe(FILE* fp, int* w, int* h, int* c)
+{
+    unsigned char marker[4];
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(marker, 1, 2, fp) != 2 || marker[0] != 0xff || marker[1] != 0xd8)
+        return 0;
+
+    for (;;)
+    {
+        if (fread(marker, 1, 4, fp) != 4 || marker[0] != 0xff)
+            return 0;
+
+        // fill bytes before a marker
+        while (marker[1] == 0xff)
+        {
+            marker[1] = marker[2];
+            marker[2] = marker[3];
+            if (fread(marker + 3, 1, 1, fp) != 1)
+                return 0;
+        }
+
+        const int type = marker[1];
+        const int length = probe_be16(marker + 2);
+        if (length < 2)
+            return 0;
+
+        // start of frame, all but dht dac and jpg extensions
+        if (type >= 0xc0 && type <= 0xcf && type != 0xc4 && type != 0xc8 && type != 0xcc)
+        {
+            unsigned char frame[6];
+            if (fread(frame, 1, 6, fp) != 6)
+                return 0;
+
+            *h = probe_be16(frame + 1);
+            *w = probe_be16(frame + 3);
+            *c = 3;
+            return 1;
+        }
+
+        // start of scan or end of image before any frame
+        if (type == 0xda || type == 0xd9)
+            return 0;
+
+        if (fseek(fp, length - 2, SEEK_CUR) != 0)
+            return 0;
+    }
+}
+
+// returns 0 for unknown formats and broken headers
+int image_probe(FILE* fp, int* w, int* h, int* c)
+{
+    unsigned char header[32];
+    const int len = (int)fread(header, 1, 32, fp);
+
+    if (png_probe(header, len, w, h, c))
+        return 1;
+
+    if (webp_probe(header, len, w, h, c))
+        return 1;
+
+    return jpeg_probe(fp, w, h, c);
+}
+
+#endif // IMAGE_PROBE_H
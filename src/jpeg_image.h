@@ -7,6 +7,9 @@
 #include <stdlib.h>
 #include "jpeglib.h"
 
+// ncnn
+#include "allocator.h"
+
 struct safe_jpeg_error_mgr
 {
     struct jpeg_error_mgr pub;
@@ -27,9 +30,11 @@ static void safe_jpeg_output_message(j_common_ptr cinfo)
 {
 }
 
-unsigned char* jpeg_load(const unsigned char* buffer, int len, int* w, int* h, int* c)
+// pixel data comes from allocator when given, malloc otherwise
+unsigned char* jpeg_load(const unsigned char* buffer, int len, int* w, int* h, int* c, ncnn::Allocator* allocator = 0)
 {
-    unsigned char* pixeldata = 0;
+    // volatile, so the error path below sees what was allocated before the longjmp
+    unsigned char* volatile pixeldata = 0;
 
     struct jpeg_decompress_struct cinfo;
     struct safe_jpeg_error_mgr jerr;
@@ -41,6 +46,13 @@ unsigned char* jpeg_load(const unsigned char* buffer, int len, int* w, int* h, i
 
     if (setjmp(jerr.setjmp_buffer))
     {
+        if (pixeldata)
+        {
+            if (allocator)
+                allocator->fastFree(pixeldata);
+            else
+                free(pixeldata);
+        }
         jpeg_destroy_decompress(&cinfo);
         return NULL;
     }
@@ -65,7 +77,13 @@ unsigned char* jpeg_load(const unsigned char* buffer, int len, int* w, int* h, i
     int width = cinfo.image_width;
     int height = cinfo.image_height;
 
-    pixeldata = (unsigned char*)malloc(width * height * 3);
+    const size_t size = (size_t)width * height * 3;
+    pixeldata = (unsigned char*)(allocator ? allocator->fastMalloc(size) : malloc(size));
+    if (!pixeldata)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
 
     while (cinfo.output_scanline < cinfo.output_height)
     {
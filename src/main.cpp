@@ -3,7 +3,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <map>
 #include <queue>
+#include <utility>
 #include <vector>
 #include <clocale>
 
@@ -16,6 +18,7 @@
 #include "png_image.h"
 #endif // _WIN32
 #include "webp_image.h"
+#include "image_probe.h"
 
 #if _WIN32
 #include <wchar.h>
@@ -83,13 +86,16 @@ static std::vector<int> parse_optarg_int_array(const char* optarg)
 #endif // _WIN32
 
 // ncnn
+#include "benchmark.h"
 #include "cpu.h"
 #include "gpu.h"
 #include "platform.h"
 
 #include "waifu2x.h"
+#include "image_pool.h"
 
 #include "filesystem_utils.h"
+#include "resource_utils.h"
 
 static void print_usage()
 {
@@ -104,90 +110,899 @@ static void print_usage()
     fprintf(stdout, "  -m model-path        waifu2x model path (default=models-cunet)\n");
     fprintf(stdout, "  -g gpu-id            gpu device to use (-1=cpu, default=auto) can be 0,1,2 for multi-gpu\n");
     fprintf(stdout, "  -j load:proc:save    thread count for load/proc/save (default=1:2:2) can be 1:2,2,2:2 for multi-gpu\n");
+    fprintf(stdout, "  -w cpu-workers       images processed at the same time on cpu, sharing the cpu proc threads (0=auto, default=0)\n");
+    fprintf(stdout, "  -c cpu-tile-threads  concurrent tiles for each cpu worker (0=auto, default=0)\n");
+    fprintf(stdout, "  -q core-budget       cpu cores shared by decoding, cpu inference and encoding (0=auto, default=0)\n");
+    fprintf(stdout, "  -y                   bind cpu workers and their memory to numa nodes\n");
+    fprintf(stdout, "  -u tile-cache-size   tile cache in MB shared by all proc threads (0=off, default=0)\n");
+    fprintf(stdout, "  -k flat-threshold    tiles within this 8bit level range skip the model (-1=off, default=-1)\n");
     fprintf(stdout, "  -x                   enable tta mode\n");
+    fprintf(stdout, "  -a tta-count         tta transform count, implies -x (2/4/8, default=8)\n");
+    fprintf(stdout, "  -e tta-threshold     adaptive tta, run the rest only where the first pair differs more (0=off, default=0)\n");
     fprintf(stdout, "  -f format            output image format (jpg/png/webp, default=ext/png)\n");
+    fprintf(stdout, "  -r                   keep a fully opaque alpha channel in png/webp output\n");
+    fprintf(stdout, "  -d cache-dir         reuse outputs of unchanged inputs stored in this directory\n");
+    fprintf(stdout, "  -l journal-path      record finished outputs and skip them when run again\n");
+    fprintf(stdout, "  -b max-memory        memory budget in MB for images in flight (0=auto, default=0)\n");
+    fprintf(stdout, "  -p split-size        split images of this many megapixels across all gpus (-1=single file input, 0=off, default=-1)\n");
+    fprintf(stdout, "  -z                   back pooled image buffers with huge pages\n");
 }
 
+// tile rows of one image in flight, shared by the proc threads of its waifu2x instance
+class TileRowJob
+{
+public:
+    TileRowJob(const Waifu2x* _waifu2x, int _device, const ncnn::Mat* _inimage, ncnn::Mat* _outimage, int _count, int _refcount)
+    {
+        waifu2x = _waifu2x;
+        device = _device;
+        inimage = _inimage;
+        outimage = _outimage;
+        count = _count;
+        next = 0;
+        done = 0;
+        refcount = _refcount;
+        start = ncnn::get_current_time();
+    }
+
+    // take rows until none is left
+    void work();
+
+    // until the rows taken by others are done as well
+    void wait()
+    {
+        lock.lock();
+
+        while (done < count)
+        {
+            condition.wait(lock);
+        }
+
+        lock.unlock();
+    }
+
+    // drop one reference, true for the last one
+    bool release()
+    {
+        lock.lock();
+        const bool last = --refcount == 0;
+        lock.unlock();
+
+        return last;
+    }
+
+public:
+    const Waifu2x* waifu2x;
+
+private:
+    int device;
+    const ncnn::Mat* inimage;
+    ncnn::Mat* outimage;
+    int count;
+    int next;
+    int done;
+    int refcount;
+    double start;
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+};
+
+// decoded inputs and upscaled outputs, reused from image to image
+ImagePool image_pool;
+
+// owns its input pixels and output image, moved from queue to queue and never copied
 class Task
 {
 public:
+    Task()
+    {
+        id = 0;
+        scale = 1;
+        input_size = 0;
+        input_mtime = 0;
+        opaque_alpha = 0;
+        memory_cost = 0;
+        pixeldata = 0;
+        job = 0;
+    }
+
+    ~Task()
+    {
+        release_input();
+    }
+
+    Task(Task&& v)
+    {
+        pixeldata = 0;
+        *this = std::move(v);
+    }
+
+    Task& operator=(Task&& v)
+    {
+        if (this == &v)
+            return *this;
+
+        release_input();
+
+        id = v.id;
+        scale = v.scale;
+        inpath = std::move(v.inpath);
+        outpath = std::move(v.outpath);
+        input_size = v.input_size;
+        input_mtime = v.input_mtime;
+        opaque_alpha = v.opaque_alpha;
+        memory_cost = v.memory_cost;
+        cachepath = std::move(v.cachepath);
+        job = v.job;
+
+        pixeldata = v.pixeldata;
+        v.pixeldata = 0;
+
+        inimage = v.inimage;
+        v.inimage.release();
+
+        outimage = v.outimage;
+        v.outimage.release();
+
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    // give the input pixels back to the pool once no pass reads them
+    void release_input()
+    {
+        inimage.release();
+
+        if (pixeldata)
+        {
+            image_pool.fastFree(pixeldata);
+            pixeldata = 0;
+        }
+    }
+
+    // the same, unless the output is the input itself as without denoise and upscale
+    // then the pixels stay until the task is destroyed after encoding
+    void release_unused_input()
+    {
+        if (outimage.data != inimage.data)
+            release_input();
+    }
+
+    // -233 ends a thread, -1 asks an idle proc thread to help with job
     int id;
     int scale;
 
     path_t inpath;
     path_t outpath;
 
-    ncnn::Mat inimage;
-    ncnn::Mat outimage;
-};
+    // input file size and mtime at load, for the journal
+    long long input_size;
+    long long input_mtime;
+
+    // the input had an alpha channel of all 255, dropped at load
+    int opaque_alpha;
+
+    // bytes reserved from the memory budget until saved
+    size_t memory_cost;
+
+    // where to store a copy of the output for later runs, empty for none
+    path_t cachepath;
+
+    // pool buffer behind inimage, which only wraps it
+    unsigned char* pixeldata;
+
+    ncnn::Mat inimage;
+
+    // refcounted, allocated from the pool
+    ncnn::Mat outimage;
+
+    TileRowJob* job;
+};
+
+class TaskQueue
+{
+public:
+    TaskQueue()
+    {
+    }
+
+    // never blocks, the memory budget bounds the tasks in flight
+    void put(Task&& v)
+    {
+        lock.lock();
+
+        tasks.push(std::move(v));
+
+        lock.unlock();
+
+        condition.signal();
+    }
+
+    // ask an idle thread to help with job, handed out as a task with id -1 before any queued task
+    void put_help(TileRowJob* job)
+    {
+        lock.lock();
+
+        helps.push(job);
+
+        lock.unlock();
+
+        condition.signal();
+    }
+
+    void get(Task& v)
+    {
+        lock.lock();
+
+        while (tasks.empty() && helps.empty())
+        {
+            condition.wait(lock);
+        }
+
+        take(v);
+
+        lock.unlock();
+
+        condition.signal();
+    }
+
+    // queued tasks, help requests are rows of tasks already taken and do not count
+    size_t size()
+    {
+        lock.lock();
+        const size_t n = tasks.size();
+        lock.unlock();
+
+        return n;
+    }
+
+    // never blocks, false when empty
+    bool try_get(Task& v)
+    {
+        lock.lock();
+
+        const bool got = !tasks.empty() || !helps.empty();
+        if (got)
+        {
+            take(v);
+        }
+
+        lock.unlock();
+
+        return got;
+    }
+
+private:
+    void take(Task& v)
+    {
+        if (!helps.empty())
+        {
+            Task help;
+            help.id = -1;
+            help.job = helps.front();
+            helps.pop();
+
+            v = std::move(help);
+            return;
+        }
+
+        v = std::move(tasks.front());
+        tasks.pop();
+    }
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    std::queue<Task> tasks;
+    std::queue<TileRowJob*> helps;
+};
+
+TaskQueue toproc;
+TaskQueue tosave;
+
+// bytes of the images between decoding and encoding
+class MemoryBudget
+{
+public:
+    MemoryBudget()
+    {
+        budget = 0;
+        used = 0;
+    }
+
+    void set_budget(size_t _budget)
+    {
+        budget = _budget;
+    }
+
+    // block until size fits, a task larger than the whole budget runs alone
+    void acquire(size_t size)
+    {
+        lock.lock();
+
+        while (used != 0 && used + size > budget)
+        {
+            condition.wait(lock);
+        }
+
+        used += size;
+
+        lock.unlock();
+    }
+
+    void release(size_t size)
+    {
+        lock.lock();
+
+        used -= size;
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+private:
+    size_t budget;
+    size_t used;
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+};
+
+MemoryBudget memory_budget;
+
+// moves threads between decoding and encoding as the queues show which one falls behind
+// both stages start enough threads for the whole budget and only limit of them run
+class StageBalancer
+{
+public:
+    enum
+    {
+        STAGE_LOAD = 0,
+        STAGE_SAVE = 1
+    };
+
+    StageBalancer()
+    {
+        limit[STAGE_LOAD] = 1;
+        limit[STAGE_SAVE] = 1;
+        active[STAGE_LOAD] = 0;
+        active[STAGE_SAVE] = 0;
+        slot_time[STAGE_LOAD] = 0.0;
+        slot_time[STAGE_SAVE] = 0.0;
+        jobs_proc = 1;
+        last_change = 0.0;
+        finished = false;
+    }
+
+    void init(int jobs_load, int jobs_save, int _jobs_proc)
+    {
+        limit[STAGE_LOAD] = jobs_load;
+        limit[STAGE_SAVE] = jobs_save;
+        jobs_proc = _jobs_proc;
+    }
+
+    void enter(int stage)
+    {
+        lock.lock();
+
+        rebalance();
+
+        while (!finished && active[stage] >= limit[stage])
+        {
+            condition.wait(lock);
+        }
+
+        active[stage]++;
+
+        lock.unlock();
+    }
+
+    // slot_time is how long this decode or encode held its slot
+    void leave(int stage, double slot_time_ms)
+    {
+        lock.lock();
+
+        active[stage]--;
+
+        // moving average, images differ in size
+        slot_time[stage] = slot_time[stage] == 0.0 ? slot_time_ms : slot_time[stage] * 0.8 + slot_time_ms * 0.2;
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+    // let every waiting thread through to its end marker
+    void finish()
+    {
+        lock.lock();
+
+        finished = true;
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+    // threads a stage can ever run at once, its own share and all but one of the other
+    int max_limit(int stage) const
+    {
+        return limit[stage] + limit[1 - stage] - 1;
+    }
+
+    int load_limit() const
+    {
+        return limit[STAGE_LOAD];
+    }
+
+    int save_limit() const
+    {
+        return limit[STAGE_SAVE];
+    }
+
+private:
+    void rebalance()
+    {
+        // one step at a time, after the last one had time to show
+        const double now = ncnn::get_current_time();
+        if (now - last_change < 500.0)
+            return;
+
+        const size_t proc_depth = toproc.size();
+        const size_t save_depth = tosave.size();
+
+        int from = -1;
+
+        // encoding falls behind while the proc threads still have images queued
+        if (save_depth > (size_t)limit[STAGE_SAVE] && proc_depth >= (size_t)jobs_proc)
+            from = STAGE_LOAD;
+
+        // the proc threads are about to run dry while encoding keeps up
+        if (proc_depth < (size_t)jobs_proc && save_depth == 0)
+            from = STAGE_SAVE;
+
+        if (from == -1 || limit[from] <= 1)
+            return;
+
+        // queue depths only tell where images pile up, the measured slot times tell whether a thread moved
+        // actually helps, do not move towards a stage that already gets through more images per second
+        const int to = 1 - from;
+        if (slot_time[from] > 0.0 && slot_time[to] > 0.0 && limit[to] * slot_time[from] >= limit[from] * slot_time[to])
+            return;
+
+        limit[from]--;
+        limit[1 - from]++;
+        last_change = now;
+
+        condition.broadcast();
+    }
+
+    int limit[2];
+    int active[2];
+    double slot_time[2];
+    int jobs_proc;
+    double last_change;
+    bool finished;
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+};
+
+StageBalancer stage_balancer;
+
+// one running decode or encode for as long as it is in scope
+class StageSlot
+{
+public:
+    StageSlot(int _stage) : stage(_stage)
+    {
+        stage_balancer.enter(stage);
+
+        start = ncnn::get_current_time();
+    }
+
+    ~StageSlot()
+    {
+        stage_balancer.leave(stage, ncnn::get_current_time() - start);
+    }
+
+private:
+    int stage;
+    double start;
+};
+
+// cpu cores shared by decoding, cpu inference and encoding, inference goes first
+class CoreBudget
+{
+public:
+    CoreBudget()
+    {
+        budget = 1;
+        used = 0;
+        io_used = 0;
+        inference_waiting = 0;
+    }
+
+    void set_budget(int _budget)
+    {
+        lock.lock();
+
+        budget = _budget;
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+    // decoding and encoding wait while inference waits, but one of them always gets through so the queues keep moving
+    // more than the whole budget runs alone
+    void acquire(int cores, bool inference)
+    {
+        lock.lock();
+
+        if (inference)
+            inference_waiting++;
+
+        while ((used != 0 && used + cores > budget) || (!inference && inference_waiting > 0 && io_used != 0))
+        {
+            condition.wait(lock);
+        }
+
+        if (inference)
+            inference_waiting--;
+
+        used += cores;
+        if (!inference)
+            io_used += cores;
+
+        lock.unlock();
+    }
+
+    void release(int cores, bool inference)
+    {
+        lock.lock();
+
+        used -= cores;
+        if (!inference)
+            io_used -= cores;
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+private:
+    int budget;
+    int used;
+    int io_used;
+    int inference_waiting;
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+};
+
+CoreBudget core_budget;
+
+// cpu threads each waifu2x instance runs with, 0 for gpu
+std::vector<int> device_cpu_threads;
+
+// numa node cpus each waifu2x instance runs on, empty for no binding
+std::vector<std::vector<int> > device_bind_cpus;
+
+// peak bytes a decoded w x h x c image holds until saved
+static size_t task_memory_cost(int w, int h, int c, int scale, bool expand_alpha)
+{
+    const size_t insize = (size_t)w * h * c;
+    const size_t outsize = insize * scale * scale;
+
+    size_t cost = insize + outsize;
+
+    // proc keeps the previous 2x step while upscaling to the next
+    if (scale > 2)
+        cost += outsize / 4;
+
+    // save expands opaque alpha back to rgba
+    if (expand_alpha)
+        cost += outsize / 3 * 4;
+
+    return cost;
+}
+
+// rough host memory of one tile in flight on cpu, input and output blob of the widest layer in fp32
+static size_t tile_working_set(int tilesize, int prepadding)
+{
+    const size_t size = tilesize + prepadding * 2;
+    return size * size * sizeof(float) * 256 * 2;
+}
+
+// tiles of one cpu worker in flight at once, tta variants of a tile counted apart
+static int cpu_tiles_in_flight(int num_threads, int cpu_tile_threads, int tta_mode)
+{
+    const int tile_jobs = cpu_tile_threads ? std::min(cpu_tile_threads, num_threads) : std::max(num_threads / 4, 1);
+    const int variant_jobs = tta_mode ? std::min(tta_mode, std::max(num_threads / tile_jobs, 1)) : 1;
+    return tile_jobs * variant_jobs;
+}
+
+// finished outputs, one line per output appended by the save threads
+// settings hash, input size, input mtime, input path, tab, output path
+class Journal
+{
+public:
+    Journal()
+    {
+        fp = 0;
+    }
+
+    ~Journal()
+    {
+        if (fp)
+            fclose(fp);
+    }
+
+    // read the entries of earlier runs and open for appending
+    bool open(const path_t& path, const TileCacheKey& _settings)
+    {
+        settings = _settings;
+
+#if _WIN32
+        FILE* infp = _wfopen(path.c_str(), L"r, ccs=UTF-8");
+#else
+        FILE* infp = fopen(path.c_str(), "r");
+#endif
+        if (infp)
+        {
+            path_t line;
+            while (read_line(infp, line))
+            {
+                unsigned long long h0;
+                unsigned long long h1;
+                Entry entry;
+                int n = 0;
+#if _WIN32
+                if (swscanf(line.c_str(), L"%16llx%16llx %lld %lld %n", &h0, &h1, &entry.size, &entry.mtime, &n) != 4 || n == 0)
+                    continue;
+#else
+                if (sscanf(line.c_str(), "%16llx%16llx %lld %lld %n", &h0, &h1, &entry.size, &entry.mtime, &n) != 4 || n == 0)
+                    continue;
+#endif
+
+                // lines written under other settings do not count
+                if (h0 != settings.h0 || h1 != settings.h1)
+                    continue;
+
+                // a line cut short by a kill or garbled in any other way is skipped
+                const size_t tab = line.find(PATHSTR('\t'), n);
+                if (tab == path_t::npos || line.find(PATHSTR('\t'), tab + 1) != path_t::npos)
+                    continue;
+
+                path_t inpath;
+                if (!unescape(line.substr(n, tab - n), inpath) || !unescape(line.substr(tab + 1), entry.outpath))
+                    continue;
+
+                if (inpath.empty() || entry.outpath.empty())
+                    continue;
+
+                // later lines win, an input changed and processed again has a newer line
+                entries[inpath] = entry;
+            }
+
+            fclose(infp);
+        }
+
+#if _WIN32
+        fp = _wfopen(path.c_str(), L"a, ccs=UTF-8");
+#else
+        fp = fopen(path.c_str(), "a");
+#endif
+        return fp != 0;
+    }
+
+    // the input is unchanged since an earlier run wrote outpath, or outpath.png for alpha inputs, and that output is still there
+    bool is_done(const path_t& inpath, long long size, long long mtime, const path_t& outpath) const
+    {
+        std::map<path_t, Entry>::const_iterator it = entries.find(inpath);
+        if (it == entries.end())
+            return false;
+
+        const Entry& entry = it->second;
+        if (entry.size != size || entry.mtime != mtime)
+            return false;
+
+        if (entry.outpath != outpath && entry.outpath != outpath + PATHSTR(".png"))
+            return false;
 
-class TaskQueue
-{
-public:
-    TaskQueue()
+        return filepath_is_readable(entry.outpath);
+    }
+
+    void record(const path_t& inpath, long long size, long long mtime, const path_t& outpath)
     {
+        if (!fp)
+            return;
+
+        const path_t escaped_inpath = escape(inpath);
+        const path_t escaped_outpath = escape(outpath);
+
+        ncnn::MutexLockGuard guard(lock);
+
+#if _WIN32
+        fwprintf(fp, L"%016llx%016llx %lld %lld %ls\t%ls\n", (unsigned long long)settings.h0, (unsigned long long)settings.h1, size, mtime, escaped_inpath.c_str(), escaped_outpath.c_str());
+#else
+        fprintf(fp, "%016llx%016llx %lld %lld %s\t%s\n", (unsigned long long)settings.h0, (unsigned long long)settings.h1, size, mtime, escaped_inpath.c_str(), escaped_outpath.c_str());
+#endif
+
+        // keep the progress when killed
+        fflush(fp);
     }
 
-    void put(const Task& v)
+private:
+    // one whole line of any length without the newline, false at the end or on a last line without newline
+    static bool read_line(FILE* fp, path_t& line)
     {
-        lock.lock();
+        line.clear();
 
-        while (tasks.size() >= 8) // FIXME hardcode queue length
+#if _WIN32
+        wchar_t buf[8192];
+        while (fgetws(buf, 8192, fp))
+#else
+        char buf[8192];
+        while (fgets(buf, 8192, fp))
+#endif
         {
-            condition.wait(lock);
+            line += buf;
+
+            if (!line.empty() && line[line.size() - 1] == PATHSTR('\n'))
+            {
+                line.resize(line.size() - 1);
+                return true;
+            }
         }
 
-        tasks.push(v);
+        return false;
+    }
 
-        lock.unlock();
+    // paths may hold tabs and newlines, write those and % as %xx so every entry stays on one line
+    static path_t escape(const path_t& path)
+    {
+        path_t escaped;
+        for (size_t i = 0; i < path.size(); i++)
+        {
+            const path_t::value_type ch = path[i];
+            if (ch == PATHSTR('%') || ch == PATHSTR('\t') || ch == PATHSTR('\n') || ch == PATHSTR('\r'))
+            {
+                const char* hex = "0123456789ABCDEF";
+                escaped += PATHSTR('%');
+                escaped += (path_t::value_type)hex[ch >> 4];
+                escaped += (path_t::value_type)hex[ch & 15];
+            }
+            else
+            {
+                escaped += ch;
+            }
+        }
 
-        condition.signal();
+        return escaped;
     }
 
-    void get(Task& v)
+    static int hex_value(path_t::value_type ch)
     {
-        lock.lock();
+        if (ch >= PATHSTR('0') && ch <= PATHSTR('9'))
+            return ch - PATHSTR('0');
+        if (ch >= PATHSTR('A') && ch <= PATHSTR('F'))
+            return ch - PATHSTR('A') + 10;
+        return -1;
+    }
 
-        while (tasks.size() == 0)
+    static bool unescape(const path_t& escaped, path_t& path)
+    {
+        path.clear();
+        for (size_t i = 0; i < escaped.size(); i++)
         {
-            condition.wait(lock);
-        }
+            if (escaped[i] != PATHSTR('%'))
+            {
+                path += escaped[i];
+                continue;
+            }
 
-        v = tasks.front();
-        tasks.pop();
+            if (i + 2 >= escaped.size())
+                return false;
 
-        lock.unlock();
+            const int hi = hex_value(escaped[i + 1]);
+            const int lo = hex_value(escaped[i + 2]);
+            if (hi < 0 || lo < 0)
+                return false;
 
-        condition.signal();
+            path += (path_t::value_type)(hi * 16 + lo);
+            i += 2;
+        }
+
+        return true;
     }
 
-private:
+    class Entry
+    {
+    public:
+        long long size;
+        long long mtime;
+        path_t outpath;
+    };
+
+    TileCacheKey settings;
+    std::map<path_t, Entry> entries;
+
     ncnn::Mutex lock;
-    ncnn::ConditionVariable condition;
-    std::queue<Task> tasks;
+    FILE* fp;
 };
 
-TaskQueue toproc;
-TaskQueue tosave;
+Journal journal;
 
 class LoadThreadParams
 {
 public:
     int scale;
     int jobs_load;
+    int verbose;
+    int keep_alpha;
+
+    // result cache, cache_dir is empty for none
+    path_t cache_dir;
+    TileCacheKey cache_settings;
 
     // session data
     std::vector<path_t> input_files;
     std::vector<path_t> output_files;
 };
 
+// repack rgba pixeldata whose alpha is 255 everywhere to rgb in place, returns whether it did
+static bool drop_opaque_alpha(unsigned char* pixeldata, int w, int h)
+{
+    const size_t size = (size_t)w * h;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (pixeldata[i * 4 + 3] != 255)
+            return false;
+    }
+
+    for (size_t i = 0; i < size; i++)
+    {
+        pixeldata[i * 3] = pixeldata[i * 4];
+        pixeldata[i * 3 + 1] = pixeldata[i * 4 + 1];
+        pixeldata[i * 3 + 2] = pixeldata[i * 4 + 2];
+    }
+
+    return true;
+}
+
+static bool is_jpeg_extension(const path_t& ext)
+{
+    return ext == PATHSTR("jpg") || ext == PATHSTR("JPG") || ext == PATHSTR("jpeg") || ext == PATHSTR("JPEG");
+}
+
+// cache file of the output of filedata under the given settings, without extension
+static path_t cache_file_path(const path_t& cache_dir, const TileCacheKey& settings, const unsigned char* filedata, int length)
+{
+    TileHasher hasher;
+    hasher.update(&settings, sizeof(settings));
+    hasher.update(filedata, length);
+    const TileCacheKey key = hasher.key();
+
+    char name[33];
+    sprintf(name, "%016llx%016llx", (unsigned long long)key.h0, (unsigned long long)key.h1);
+
+    return cache_dir + PATHSTR('/') + path_t(name, name + 32);
+}
+
 void* load(void* args)
 {
     const LoadThreadParams* ltp = (const LoadThreadParams*)args;
     const int count = ltp->input_files.size();
     const int scale = ltp->scale;
 
-    #pragma omp parallel for schedule(static,1) num_threads(ltp->jobs_load)
+    // dynamic keeps the largest first order of the input list across load threads
+    #pragma omp parallel for schedule(dynamic) num_threads(ltp->jobs_load)
     for (int i=0; i<count; i++)
     {
         const path_t& imagepath = ltp->input_files[i];
@@ -196,6 +1011,14 @@ void* load(void* args)
         int w;
         int h;
         int c;
+        path_t cachepath;
+
+        long long input_size = 0;
+        long long input_mtime = 0;
+        get_file_stat(imagepath, &input_size, &input_mtime);
+
+        // memory budget reserved ahead of decoding
+        size_t reserved_cost = 0;
 
 #if _WIN32
         FILE* fp = _wfopen(imagepath.c_str(), L"rb");
@@ -204,6 +1027,12 @@ void* load(void* args)
 #endif
         if (fp)
         {
+            // dimensions from the header, for the memory reservation before decoding
+            int probe_w = 0;
+            int probe_h = 0;
+            int probe_c = 0;
+            const bool probed = image_probe(fp, &probe_w, &probe_h, &probe_c) && probe_w > 0 && probe_h > 0;
+
             // read whole file
             unsigned char* filedata = 0;
             int length = 0;
@@ -219,21 +1048,71 @@ void* load(void* args)
                 fclose(fp);
             }
 
-            if (filedata)
+            // outputs of unchanged inputs are copied from the cache without decoding
+            if (filedata && !ltp->cache_dir.empty())
             {
-                pixeldata = webp_load(filedata, length, &w, &h, &c);
-                if (!pixeldata)
+                cachepath = cache_file_path(ltp->cache_dir, ltp->cache_settings, filedata, length);
+
+                const path_t& outpath = ltp->output_files[i];
+                path_t cachedpath = cachepath + PATHSTR('.') + get_file_extension(outpath);
+                path_t cachedoutpath = outpath;
+                if (is_jpeg_extension(get_file_extension(outpath)) && !filepath_is_readable(cachedpath))
+                {
+                    // the input had alpha and went out as png
+                    cachedpath = cachepath + PATHSTR(".png");
+                    cachedoutpath = outpath + PATHSTR(".png");
+                }
+
+                if (filepath_is_readable(cachedpath) && copy_file(cachedpath, cachedoutpath))
                 {
-                    // not webp, try jpg png etc.
+                    if (ltp->verbose)
+                    {
 #if _WIN32
-                    pixeldata = wic_decode_image(imagepath.c_str(), &w, &h, &c);
+                        fwprintf(stdout, L"%ls -> %ls cached\n", imagepath.c_str(), cachedoutpath.c_str());
 #else // _WIN32
-                    pixeldata = jpeg_load(filedata, length, &w, &h, &c);
+                        fprintf(stdout, "%s -> %s cached\n", imagepath.c_str(), cachedoutpath.c_str());
+#endif // _WIN32
+                    }
+
+                    journal.record(imagepath, input_size, input_mtime, cachedoutpath);
+
+                    free(filedata);
+                    continue;
+                }
+            }
+
+            if (filedata)
+            {
+                // wait here until the images in flight leave room, before this load thread holds a decoded image
+                // an opaque alpha channel may be dropped and expanded again, count the larger of both
+                if (probed)
+                {
+                    reserved_cost = task_memory_cost(probe_w, probe_h, probe_c, scale, probe_c == 4 && ltp->keep_alpha);
+                    memory_budget.acquire(reserved_cost);
+                }
+
+                {
+                    // only decoding counts against the load threads of the balancer, not the waits around it
+                    StageSlot slot(StageBalancer::STAGE_LOAD);
+
+                    core_budget.acquire(1, false);
+
+                    pixeldata = webp_load(filedata, length, &w, &h, &c, &image_pool);
                     if (!pixeldata)
                     {
-                        pixeldata = png_load(filedata, length, &w, &h, &c);
-                    }
+                        // not webp, try jpg png etc.
+#if _WIN32
+                        pixeldata = wic_decode_image(imagepath.c_str(), &w, &h, &c, &image_pool);
+#else // _WIN32
+                        pixeldata = jpeg_load(filedata, length, &w, &h, &c, &image_pool);
+                        if (!pixeldata)
+                        {
+                            pixeldata = png_load(filedata, length, &w, &h, &c, &image_pool);
+                        }
 #endif // _WIN32
+                    }
+
+                    core_budget.release(1, false);
                 }
 
                 free(filedata);
@@ -246,9 +1125,32 @@ void* load(void* args)
             v.scale = scale;
             v.inpath = imagepath;
             v.outpath = ltp->output_files[i];
+            v.input_size = input_size;
+            v.input_mtime = input_mtime;
+
+            // an alpha channel that hides nothing only costs time and memory, process as rgb
+            v.opaque_alpha = c == 4 && drop_opaque_alpha(pixeldata, w, h);
+            if (v.opaque_alpha)
+            {
+                c = 3;
+            }
 
+            v.pixeldata = pixeldata;
             v.inimage = ncnn::Mat(w, h, (void*)pixeldata, (size_t)c, c);
 
+            // settle the reservation on the decoded size, a png whose trns chunk adds alpha needs more than its header said
+            // headers the probe does not know wait here instead, after decoding
+            v.memory_cost = task_memory_cost(w, h, c, scale, v.opaque_alpha && ltp->keep_alpha);
+            if (v.memory_cost <= reserved_cost)
+            {
+                memory_budget.release(reserved_cost - v.memory_cost);
+            }
+            else
+            {
+                memory_budget.release(reserved_cost);
+                memory_budget.acquire(v.memory_cost);
+            }
+
             path_t ext = get_file_extension(v.outpath);
             if (c == 4 && (ext == PATHSTR("jpg") || ext == PATHSTR("JPG") || ext == PATHSTR("jpeg") || ext == PATHSTR("JPEG")))
             {
@@ -261,10 +1163,17 @@ void* load(void* args)
 #endif // _WIN32
             }
 
-            toproc.put(v);
+            if (!cachepath.empty())
+            {
+                v.cachepath = cachepath + PATHSTR('.') + get_file_extension(v.outpath);
+            }
+
+            toproc.put(std::move(v));
         }
         else
         {
+            memory_budget.release(reserved_cost);
+
 #if _WIN32
             fwprintf(stderr, L"decode image %ls failed\n", imagepath.c_str());
 #else // _WIN32
@@ -276,16 +1185,294 @@ void* load(void* args)
     return 0;
 }
 
+// input pixels per millisecond of each waifu2x instance, measured on every image and band
+class DeviceThroughput
+{
+public:
+    void init(const std::vector<int>& gpuid)
+    {
+        is_cpu.resize(gpuid.size());
+        pixels_per_ms.resize(gpuid.size(), 0.0);
+        for (size_t i=0; i<gpuid.size(); i++)
+        {
+            is_cpu[i] = gpuid[i] == -1;
+        }
+    }
+
+    void record(int device, double pixels, double ms)
+    {
+        if (ms <= 0.0)
+            return;
+
+        ncnn::MutexLockGuard guard(lock);
+
+        // moving average, the first measurement counts in full
+        const double v = pixels / ms;
+        pixels_per_ms[device] = pixels_per_ms[device] == 0.0 ? v : pixels_per_ms[device] * 0.7 + v * 0.3;
+    }
+
+    // relative speed of each instance
+    std::vector<double> weights() const
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        bool measured = true;
+        for (size_t i=0; i<pixels_per_ms.size(); i++)
+        {
+            if (pixels_per_ms[i] == 0.0)
+                measured = false;
+        }
+
+        if (measured)
+            return pixels_per_ms;
+
+        // rough guess until every instance has run once, a gpu is far faster than the cpu
+        std::vector<double> guess(pixels_per_ms.size());
+        for (size_t i=0; i<guess.size(); i++)
+        {
+            guess[i] = is_cpu[i] ? 0.05 : 1.0;
+        }
+
+        return guess;
+    }
+
+private:
+    std::vector<bool> is_cpu;
+    std::vector<double> pixels_per_ms;
+
+    mutable ncnn::Mutex lock;
+};
+
+DeviceThroughput device_throughput;
+
+// rows y0 to y1 of outimage, all of it when they span the whole image
+static void process_measured(const Waifu2x* waifu2x, int device, const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1)
+{
+    const int cores = device_cpu_threads[device];
+    if (cores)
+    {
+        core_budget.acquire(cores, true);
+    }
+
+    double start = ncnn::get_current_time();
+
+    if (y0 == 0 && y1 == inimage.h)
+        waifu2x->process(inimage, outimage);
+    else
+        waifu2x->process_band(inimage, outimage, y0, y1);
+
+    device_throughput.record(device, (double)inimage.w * (y1 - y0), ncnn::get_current_time() - start);
+
+    if (cores)
+    {
+        core_budget.release(cores, true);
+    }
+}
+
+void TileRowJob::work()
+{
+    const int cores = device_cpu_threads[device];
+
+    for (;;)
+    {
+        lock.lock();
+        const int yi = next++;
+        lock.unlock();
+
+        if (yi >= count)
+            break;
+
+        // rows run by helpers take their cores like any other inference
+        if (cores)
+        {
+            core_budget.acquire(cores, true);
+        }
+
+        waifu2x->process_rows(*inimage, *outimage, yi, yi + 1);
+
+        if (cores)
+        {
+            core_budget.release(cores, true);
+        }
+
+        lock.lock();
+        done++;
+        const bool finished = done == count;
+        lock.unlock();
+
+        if (finished)
+        {
+            // the instance speed is the whole image over the time all its threads took, whichever ran the last row
+            device_throughput.record(device, (double)inimage->w * inimage->h, ncnn::get_current_time() - start);
+
+            condition.broadcast();
+        }
+    }
+}
+
+// rows y0 to y1 of one image on one instance
+class BandParams
+{
+public:
+    const Waifu2x* waifu2x;
+    int device;
+
+    const ncnn::Mat* inimage;
+    ncnn::Mat* outimage;
+    int y0;
+    int y1;
+};
+
+void* process_band(void* args)
+{
+    const BandParams* bp = (const BandParams*)args;
+    const ncnn::Mat& inimage = *bp->inimage;
+    ncnn::Mat& outimage = *bp->outimage;
+
+    bind_current_thread(device_bind_cpus[bp->device]);
+
+    // the band is upscaled straight into its rows of the shared output, the input rows around it are the model context
+    process_measured(bp->waifu2x, bp->device, inimage, outimage, bp->y0, bp->y1);
+
+    return 0;
+}
+
 class ProcThreadParams
 {
 public:
     const Waifu2x* waifu2x;
+    int device;
+
+    // proc threads running this instance
+    int device_jobs;
+
+    // every instance, one image with at least split_pixels input pixels is spread over all of them, 0 = never
+    std::vector<Waifu2x*> waifu2x_all;
+    long long split_pixels;
 };
 
+// one pass on this instance, the tile rows are offered to the idle proc threads of the same instance
+static void process_shared(const ProcThreadParams* ptp, const ncnn::Mat& inimage, ncnn::Mat& outimage)
+{
+    const Waifu2x* waifu2x = ptp->waifu2x;
+
+    const int rows = waifu2x->tile_rows(inimage);
+    const int helpers = std::min(rows, ptp->device_jobs) - 1;
+    if (helpers <= 0)
+    {
+        process_measured(waifu2x, ptp->device, inimage, outimage, 0, inimage.h);
+        return;
+    }
+
+    // one reference for each help request and one for this thread
+    TileRowJob* job = new TileRowJob(waifu2x, ptp->device, &inimage, &outimage, rows, helpers + 1);
+
+    for (int i=0; i<helpers; i++)
+    {
+        toproc.put_help(job);
+    }
+
+    job->work();
+    job->wait();
+
+    if (job->release())
+        delete job;
+}
+
+// one 2x or 1x pass, split into bands sized by the speed of each instance when the image is large
+static void process_pass(const ProcThreadParams* ptp, const ncnn::Mat& inimage, ncnn::Mat& outimage)
+{
+    const int device_count = (int)ptp->waifu2x_all.size();
+
+    if (ptp->split_pixels == 0 || device_count < 2 || (long long)inimage.w * inimage.h < ptp->split_pixels)
+    {
+        process_shared(ptp, inimage, outimage);
+        return;
+    }
+
+    const int h = inimage.h;
+
+    // a band shorter than its own context is not worth it
+    const int min_band_h = ptp->waifu2x->prepadding * 2;
+
+    std::vector<double> weights = device_throughput.weights();
+    std::vector<int> band_h(device_count, 0);
+    for (;;)
+    {
+        double weight_sum = 0.0;
+        for (int i=0; i<device_count; i++)
+        {
+            weight_sum += weights[i];
+        }
+
+        for (int i=0; i<device_count; i++)
+        {
+            band_h[i] = (int)(h * weights[i] / weight_sum);
+        }
+
+        // drop the instances too slow for a useful band and share again
+        bool dropped = false;
+        for (int i=0; i<device_count; i++)
+        {
+            if (weights[i] > 0.0 && band_h[i] < min_band_h && i != ptp->device)
+            {
+                weights[i] = 0.0;
+                dropped = true;
+            }
+        }
+
+        if (!dropped)
+            break;
+    }
+
+    // rounding leftover goes to this thread
+    int rows = 0;
+    for (int i=0; i<device_count; i++)
+    {
+        rows += band_h[i];
+    }
+    band_h[ptp->device] += h - rows;
+
+    std::vector<BandParams> bands(device_count);
+    std::vector<ncnn::Thread*> band_threads(device_count, (ncnn::Thread*)0);
+    int y = 0;
+    for (int i=0; i<device_count; i++)
+    {
+        bands[i].waifu2x = ptp->waifu2x_all[i];
+        bands[i].device = i;
+        bands[i].inimage = &inimage;
+        bands[i].outimage = &outimage;
+        bands[i].y0 = y;
+        bands[i].y1 = y + band_h[i];
+        y += band_h[i];
+
+        if (band_h[i] > 0 && i != ptp->device)
+        {
+            band_threads[i] = new ncnn::Thread(process_band, (void*)&bands[i]);
+        }
+    }
+
+    if (band_h[ptp->device] > 0)
+    {
+        process_band((void*)&bands[ptp->device]);
+    }
+
+    for (int i=0; i<device_count; i++)
+    {
+        if (band_threads[i])
+        {
+            band_threads[i]->join();
+            delete band_threads[i];
+        }
+    }
+}
+
 void* proc(void* args)
 {
     const ProcThreadParams* ptp = (const ProcThreadParams*)args;
-    const Waifu2x* waifu2x = ptp->waifu2x;
+
+    // the ncnn thread team of this worker is created from here and stays on the same node
+    bind_current_thread(device_bind_cpus[ptp->device]);
 
     for (;;)
     {
@@ -296,13 +1483,29 @@ void* proc(void* args)
         if (v.id == -233)
             break;
 
+        // help requests from the other proc threads, stale or for another instance ones only drop the reference
+        if (v.id == -1)
+        {
+            if (v.job->waifu2x == ptp->waifu2x)
+            {
+                v.job->work();
+            }
+
+            if (v.job->release())
+                delete v.job;
+
+            continue;
+        }
+
         const int scale = v.scale;
         if (scale == 1)
         {
-            v.outimage = ncnn::Mat(v.inimage.w, v.inimage.h, (size_t)v.inimage.elemsize, (int)v.inimage.elemsize);
-            waifu2x->process(v.inimage, v.outimage);
+            v.outimage = ncnn::Mat(v.inimage.w, v.inimage.h, (size_t)v.inimage.elemsize, (int)v.inimage.elemsize, &image_pool);
+            process_pass(ptp, v.inimage, v.outimage);
+
+            v.release_unused_input();
 
-            tosave.put(v);
+            tosave.put(std::move(v));
             continue;
         }
 
@@ -328,17 +1531,20 @@ void* proc(void* args)
             scale_run_count = 5;
         }
 
-        v.outimage = ncnn::Mat(v.inimage.w * 2, v.inimage.h * 2, (size_t)v.inimage.elemsize, (int)v.inimage.elemsize);
-        waifu2x->process(v.inimage, v.outimage);
+        v.outimage = ncnn::Mat(v.inimage.w * 2, v.inimage.h * 2, (size_t)v.inimage.elemsize, (int)v.inimage.elemsize, &image_pool);
+        process_pass(ptp, v.inimage, v.outimage);
+
+        // later passes read the previous output only
+        v.release_input();
 
         for (int i = 1; i < scale_run_count; i++)
         {
             ncnn::Mat tmp = v.outimage;
-            v.outimage = ncnn::Mat(tmp.w * 2, tmp.h * 2, (size_t)v.inimage.elemsize, (int)v.inimage.elemsize);
-            waifu2x->process(tmp, v.outimage);
+            v.outimage = ncnn::Mat(tmp.w * 2, tmp.h * 2, (size_t)tmp.elemsize, (int)tmp.elemsize, &image_pool);
+            process_pass(ptp, tmp, v.outimage);
         }
 
-        tosave.put(v);
+        tosave.put(std::move(v));
     }
 
     return 0;
@@ -348,6 +1554,7 @@ class SaveThreadParams
 {
 public:
     int verbose;
+    int keep_alpha;
 };
 
 void* save(void* args)
@@ -364,36 +1571,94 @@ void* save(void* args)
         if (v.id == -233)
             break;
 
-        // free input pixel data
-        {
-            unsigned char* pixeldata = (unsigned char*)v.inimage.data;
-            free(pixeldata);
-        }
+        // the input pixels go back to the pool before encoding
+        v.release_unused_input();
 
         int success = 0;
 
         path_t ext = get_file_extension(v.outpath);
 
-        if (ext == PATHSTR("webp") || ext == PATHSTR("WEBP"))
-        {
-            success = webp_save(v.outpath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, (const unsigned char*)v.outimage.data);
-        }
-        else if (ext == PATHSTR("png") || ext == PATHSTR("PNG"))
+        // encode next to the output and rename, so that a killed run never leaves a truncated output behind
+        path_t tmppath = v.outpath + PATHSTR(".tmp");
+
         {
+            // only encoding counts against the save threads of the balancer, not the wait for a task
+            StageSlot slot(StageBalancer::STAGE_SAVE);
+
+            core_budget.acquire(1, false);
+
+            // put back the opaque alpha dropped at load
+            if (v.opaque_alpha && stp->keep_alpha && !(ext == PATHSTR("jpg") || ext == PATHSTR("JPG") || ext == PATHSTR("jpeg") || ext == PATHSTR("JPEG")))
+            {
+                ncnn::Mat outimage_rgba(v.outimage.w, v.outimage.h, (size_t)4u, 4, &image_pool);
+
+                const unsigned char* ptr = (const unsigned char*)v.outimage.data;
+                unsigned char* outptr = (unsigned char*)outimage_rgba.data;
+
+                const size_t size = (size_t)v.outimage.w * v.outimage.h;
+                for (size_t i = 0; i < size; i++)
+                {
+                    outptr[0] = ptr[0];
+                    outptr[1] = ptr[1];
+                    outptr[2] = ptr[2];
+                    outptr[3] = 255;
+
+                    ptr += 3;
+                    outptr += 4;
+                }
+
+                v.outimage = outimage_rgba;
+            }
+
+            if (ext == PATHSTR("webp") || ext == PATHSTR("WEBP"))
+            {
+                success = webp_save(tmppath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, (const unsigned char*)v.outimage.data);
+            }
+            else if (ext == PATHSTR("png") || ext == PATHSTR("PNG"))
+            {
+#if _WIN32
+                success = wic_encode_image(tmppath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, v.outimage.data);
+#else
+                success = png_save(tmppath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, (const unsigned char*)v.outimage.data);
+#endif
+            }
+            else if (ext == PATHSTR("jpg") || ext == PATHSTR("JPG") || ext == PATHSTR("jpeg") || ext == PATHSTR("JPEG"))
+            {
 #if _WIN32
-            success = wic_encode_image(v.outpath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, v.outimage.data);
+                success = wic_encode_jpeg_image(tmppath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, v.outimage.data);
 #else
-            success = png_save(v.outpath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, (const unsigned char*)v.outimage.data);
+                success = jpeg_save(tmppath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, (const unsigned char*)v.outimage.data);
 #endif
+            }
+            core_budget.release(1, false);
         }
-        else if (ext == PATHSTR("jpg") || ext == PATHSTR("JPG") || ext == PATHSTR("jpeg") || ext == PATHSTR("JPEG"))
+
+        if (success)
+        {
+            success = replace_file(tmppath, v.outpath);
+        }
+
+        if (!success)
+        {
+            remove_file(tmppath);
+        }
+
+        if (success && !v.cachepath.empty())
         {
+            // save threads and other runs storing the same cache file each write their own temporary file
+            char tmpsuffix[64];
+            sprintf(tmpsuffix, ".%d.%d.tmp", get_process_id(), v.id);
+
+            if (!filepath_is_readable(v.cachepath) && !copy_file(v.outpath, v.cachepath, path_t(tmpsuffix, tmpsuffix + strlen(tmpsuffix))))
+            {
 #if _WIN32
-            success = wic_encode_jpeg_image(v.outpath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, v.outimage.data);
+                fwprintf(stderr, L"store %ls in cache failed\n", v.outpath.c_str());
 #else
-            success = jpeg_save(v.outpath.c_str(), v.outimage.w, v.outimage.h, v.outimage.elempack, (const unsigned char*)v.outimage.data);
+                fprintf(stderr, "store %s in cache failed\n", v.outpath.c_str());
 #endif
+            }
         }
+
         if (success)
         {
             if (verbose)
@@ -404,6 +1669,8 @@ void* save(void* args)
                 fprintf(stdout, "%s -> %s done\n", v.inpath.c_str(), v.outpath.c_str());
 #endif
             }
+
+            journal.record(v.inpath, v.input_size, v.input_mtime, v.outpath);
         }
         else
         {
@@ -413,6 +1680,9 @@ void* save(void* args)
             fprintf(stderr, "encode image %s failed\n", v.outpath.c_str());
 #endif
         }
+
+        v.outimage.release();
+        memory_budget.release(v.memory_cost);
     }
 
     return 0;
@@ -436,13 +1706,26 @@ int main(int argc, char** argv)
     std::vector<int> jobs_proc;
     int jobs_save = 2;
     int verbose = 0;
+    int keep_alpha = 0;
     int tta_mode = 0;
+    float tta_threshold = 0.f;
+    int cpu_workers = 0;
+    int cpu_tile_threads = 0;
+    int core_count = 0;
+    int numa_bind = 0;
+    int tile_cache_size = 0;
+    int flat_threshold = -1;
     path_t format = PATHSTR("png");
+    path_t cache_dir;
+    path_t journalpath;
+    int max_memory = 0;
+    int split_size = -1;
+    int huge_pages = 0;
 
 #if _WIN32
     setlocale(LC_ALL, "");
     wchar_t opt;
-    while ((opt = getopt(argc, argv, L"i:o:n:s:t:m:g:j:f:vxh")) != (wchar_t)-1)
+    while ((opt = getopt(argc, argv, L"i:o:n:s:t:m:g:j:w:c:q:u:k:f:a:e:d:l:b:p:vrxyzh")) != (wchar_t)-1)
     {
         switch (opt)
         {
@@ -471,14 +1754,57 @@ int main(int argc, char** argv)
             swscanf(optarg, L"%d:%*[^:]:%d", &jobs_load, &jobs_save);
             jobs_proc = parse_optarg_int_array(wcschr(optarg, L':') + 1);
             break;
+        case L'w':
+            cpu_workers = _wtoi(optarg);
+            break;
+        case L'c':
+            cpu_tile_threads = _wtoi(optarg);
+            break;
+        case L'q':
+            core_count = _wtoi(optarg);
+            break;
+        case L'u':
+            tile_cache_size = _wtoi(optarg);
+            break;
+        case L'k':
+            flat_threshold = _wtoi(optarg);
+            break;
         case L'f':
             format = optarg;
             break;
         case L'v':
             verbose = 1;
             break;
+        case L'r':
+            keep_alpha = 1;
+            break;
         case L'x':
-            tta_mode = 1;
+            if (tta_mode == 0)
+                tta_mode = 8;
+            break;
+        case L'y':
+            numa_bind = 1;
+            break;
+        case L'z':
+            huge_pages = 1;
+            break;
+        case L'a':
+            tta_mode = _wtoi(optarg);
+            break;
+        case L'e':
+            tta_threshold = (float)_wtof(optarg);
+            break;
+        case L'd':
+            cache_dir = optarg;
+            break;
+        case L'l':
+            journalpath = optarg;
+            break;
+        case L'b':
+            max_memory = _wtoi(optarg);
+            break;
+        case L'p':
+            split_size = _wtoi(optarg);
             break;
         case L'h':
         default:
@@ -488,7 +1814,7 @@ int main(int argc, char** argv)
     }
 #else // _WIN32
     int opt;
-    while ((opt = getopt(argc, argv, "i:o:n:s:t:m:g:j:f:vxh")) != -1)
+    while ((opt = getopt(argc, argv, "i:o:n:s:t:m:g:j:w:c:q:u:k:f:a:e:d:l:b:p:vrxyzh")) != -1)
     {
         switch (opt)
         {
@@ -517,14 +1843,57 @@ int main(int argc, char** argv)
             sscanf(optarg, "%d:%*[^:]:%d", &jobs_load, &jobs_save);
             jobs_proc = parse_optarg_int_array(strchr(optarg, ':') + 1);
             break;
+        case 'w':
+            cpu_workers = atoi(optarg);
+            break;
+        case 'c':
+            cpu_tile_threads = atoi(optarg);
+            break;
+        case 'q':
+            core_count = atoi(optarg);
+            break;
+        case 'u':
+            tile_cache_size = atoi(optarg);
+            break;
+        case 'k':
+            flat_threshold = atoi(optarg);
+            break;
         case 'f':
             format = optarg;
             break;
         case 'v':
             verbose = 1;
             break;
+        case 'r':
+            keep_alpha = 1;
+            break;
         case 'x':
-            tta_mode = 1;
+            if (tta_mode == 0)
+                tta_mode = 8;
+            break;
+        case 'y':
+            numa_bind = 1;
+            break;
+        case 'z':
+            huge_pages = 1;
+            break;
+        case 'a':
+            tta_mode = atoi(optarg);
+            break;
+        case 'e':
+            tta_threshold = (float)atof(optarg);
+            break;
+        case 'd':
+            cache_dir = optarg;
+            break;
+        case 'l':
+            journalpath = optarg;
+            break;
+        case 'b':
+            max_memory = atoi(optarg);
+            break;
+        case 'p':
+            split_size = atoi(optarg);
             break;
         case 'h':
         default:
@@ -573,6 +1942,66 @@ int main(int argc, char** argv)
         return -1;
     }
 
+    if (cpu_workers < 0)
+    {
+        fprintf(stderr, "invalid cpu-workers argument\n");
+        return -1;
+    }
+
+    if (cpu_tile_threads < 0)
+    {
+        fprintf(stderr, "invalid cpu tile thread count argument\n");
+        return -1;
+    }
+
+    if (core_count < 0)
+    {
+        fprintf(stderr, "invalid core-budget argument\n");
+        return -1;
+    }
+
+    if (tile_cache_size < 0)
+    {
+        fprintf(stderr, "invalid tile-cache-size argument\n");
+        return -1;
+    }
+
+    if (flat_threshold < -1)
+    {
+        fprintf(stderr, "invalid flat-threshold argument\n");
+        return -1;
+    }
+
+    if (tta_mode != 0 && tta_mode != 2 && tta_mode != 4 && tta_mode != 8)
+    {
+        fprintf(stderr, "invalid tta-count argument\n");
+        return -1;
+    }
+
+    if (tta_threshold < 0.f)
+    {
+        fprintf(stderr, "invalid tta-threshold argument\n");
+        return -1;
+    }
+
+    if (max_memory < 0)
+    {
+        fprintf(stderr, "invalid max-memory argument\n");
+        return -1;
+    }
+
+    if (split_size < -1)
+    {
+        fprintf(stderr, "invalid split-size argument\n");
+        return -1;
+    }
+
+    if (!cache_dir.empty() && !path_is_directory(cache_dir))
+    {
+        fprintf(stderr, "invalid cache-dir argument\n");
+        return -1;
+    }
+
     if (jobs_proc.size() != (gpuid.empty() ? 1 : gpuid.size()) && !jobs_proc.empty())
     {
         fprintf(stderr, "invalid jobs_proc thread count argument\n");
@@ -674,6 +2103,61 @@ int main(int argc, char** argv)
         }
     }
 
+    // median input size, 0 when unknown
+    long long typical_pixels = 0;
+
+    // largest first, so that no device is left with a huge image at the end of the batch while the others idle
+    if (input_files.size() > 1)
+    {
+        const int count = (int)input_files.size();
+
+        std::vector<long long> pixel_counts(count, 0);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(jobs_load)
+        for (int i=0; i<count; i++)
+        {
+#if _WIN32
+            FILE* fp = _wfopen(input_files[i].c_str(), L"rb");
+#else
+            FILE* fp = fopen(input_files[i].c_str(), "rb");
+#endif
+            if (!fp)
+                continue;
+
+            // unknown formats sort last, in directory order
+            int w;
+            int h;
+            int c;
+            if (image_probe(fp, &w, &h, &c))
+            {
+                pixel_counts[i] = (long long)w * h;
+            }
+
+            fclose(fp);
+        }
+
+        std::vector<std::pair<long long, int> > order(count);
+        for (int i=0; i<count; i++)
+        {
+            order[i] = std::make_pair(-pixel_counts[i], i);
+        }
+
+        std::sort(order.begin(), order.end());
+
+        typical_pixels = -order[count / 2].first;
+
+        std::vector<path_t> sorted_input_files(count);
+        std::vector<path_t> sorted_output_files(count);
+        for (int i=0; i<count; i++)
+        {
+            sorted_input_files[i] = input_files[order[i].second];
+            sorted_output_files[i] = output_files[order[i].second];
+        }
+
+        input_files.swap(sorted_input_files);
+        output_files.swap(sorted_output_files);
+    }
+
     int prepadding = 0;
 
     if (model.find(PATHSTR("models-cunet")) != path_t::npos)
@@ -757,7 +2241,7 @@ int main(int argc, char** argv)
         gpuid.push_back(ncnn::get_default_gpu_index());
     }
 
-    const int use_gpu_count = (int)gpuid.size();
+    int use_gpu_count = (int)gpuid.size();
 
     if (jobs_proc.empty())
     {
@@ -769,7 +2253,8 @@ int main(int argc, char** argv)
         tilesize.resize(use_gpu_count, 0);
     }
 
-    int cpu_count = std::max(1, ncnn::get_cpu_count());
+    // the cpuset and cpu quota of a container, not the cores of the host
+    int cpu_count = get_available_cpu_count();
     jobs_load = std::min(jobs_load, cpu_count);
     jobs_save = std::min(jobs_save, cpu_count);
 
@@ -785,6 +2270,69 @@ int main(int argc, char** argv)
         }
     }
 
+    // the cpu proc threads are shared by workers, each with its own waifu2x and one image at a time
+    // many small images go faster on several narrow workers, few large ones on a single wide worker
+    // with numa binding, every node gets the same number of workers, each on the cpus of its node
+    const std::vector<std::vector<int> > numa_nodes = numa_bind ? get_numa_node_cpus() : std::vector<std::vector<int> >();
+    if (numa_bind && numa_nodes.empty() && verbose)
+    {
+        fprintf(stdout, "single numa node, no binding\n");
+    }
+    {
+        std::vector<int> worker_gpuid;
+        std::vector<int> worker_jobs_proc;
+        std::vector<int> worker_tilesize;
+        device_bind_cpus.clear();
+        for (int i=0; i<use_gpu_count; i++)
+        {
+            if (gpuid[i] != -1)
+            {
+                worker_gpuid.push_back(gpuid[i]);
+                worker_jobs_proc.push_back(jobs_proc[i]);
+                worker_tilesize.push_back(tilesize[i]);
+                device_bind_cpus.push_back(std::vector<int>());
+                continue;
+            }
+
+            const int num_threads = std::min(jobs_proc[i], cpu_count);
+
+            int workers = cpu_workers;
+            if (workers == 0)
+            {
+                // a tile keeps about 4 threads busy, give each worker the threads the tiles of a typical image can use
+                const int cpu_tilesize = tilesize[i] != 0 ? tilesize[i] : 400;
+                const long long tiles = typical_pixels / ((long long)cpu_tilesize * cpu_tilesize) + 1;
+                const int worker_threads = (int)std::min((long long)num_threads, tiles * 4);
+                workers = num_threads / worker_threads;
+            }
+            workers = std::max(std::min(workers, std::min(num_threads, (int)input_files.size())), 1);
+
+            if (!numa_nodes.empty())
+            {
+                const int node_count = (int)numa_nodes.size();
+                workers = std::min((workers + node_count - 1) / node_count * node_count, num_threads);
+            }
+
+            for (int j=0; j<workers; j++)
+            {
+                worker_gpuid.push_back(-1);
+                worker_jobs_proc.push_back(num_threads / workers + (j < num_threads % workers ? 1 : 0));
+                worker_tilesize.push_back(tilesize[i]);
+                device_bind_cpus.push_back(numa_nodes.empty() ? std::vector<int>() : numa_nodes[j % numa_nodes.size()]);
+            }
+
+            if (verbose)
+            {
+                fprintf(stdout, "cpu %d workers x %d threads\n", workers, num_threads / workers);
+            }
+        }
+
+        gpuid.swap(worker_gpuid);
+        jobs_proc.swap(worker_jobs_proc);
+        tilesize.swap(worker_tilesize);
+        use_gpu_count = (int)gpuid.size();
+    }
+
     int total_jobs_proc = 0;
     int jobs_proc_per_gpu[16] = {0};
     for (int i=0; i<use_gpu_count; i++)
@@ -808,8 +2356,24 @@ int main(int argc, char** argv)
 
         if (gpuid[i] == -1)
         {
-            // cpu only
-            tilesize[i] = 400;
+            // cpu only, the tiles in flight of all cpu workers within a quarter of the memory
+            int tiles_in_flight = 0;
+            for (int j=0; j<use_gpu_count; j++)
+            {
+                if (gpuid[j] == -1)
+                    tiles_in_flight += cpu_tiles_in_flight(jobs_proc[j], cpu_tile_threads, tta_mode);
+            }
+
+            const size_t memory_limit = get_available_memory() / 4;
+
+            if (memory_limit == 0 || tile_working_set(400, prepadding) * tiles_in_flight <= memory_limit)
+                tilesize[i] = 400;
+            else if (tile_working_set(200, prepadding) * tiles_in_flight <= memory_limit)
+                tilesize[i] = 200;
+            else if (tile_working_set(100, prepadding) * tiles_in_flight <= memory_limit)
+                tilesize[i] = 100;
+            else
+                tilesize[i] = 32;
             continue;
         }
 
@@ -817,8 +2381,8 @@ int main(int argc, char** argv)
 
         if (path_is_directory(inputpath) && path_is_directory(outputpath))
         {
-            // multiple gpu jobs share the same heap
-            heap_budget /= jobs_proc_per_gpu[gpuid[i]];
+            // multiple gpu jobs share the same heap, a band of a split image runs as one more job
+            heap_budget /= jobs_proc_per_gpu[gpuid[i]] + (split_size > 0 ? 1 : 0);
         }
 
         // more fine-grained tilesize policy here
@@ -847,7 +2411,120 @@ int main(int argc, char** argv)
         }
     }
 
+    // a single image would leave all but one device idle
+    long long split_pixels = (long long)split_size * 1000 * 1000;
+    if (split_size == -1)
+    {
+        split_pixels = path_is_directory(inputpath) ? 0 : 1;
+    }
+
+    // everything that changes the output pixels or file
+    // tile borders decide the flat tile and adaptive tta tests, and cpu fp32 and gpu fp16 round differently
+    TileCacheKey settings_key;
+    {
+        TileHasher hasher;
+        hasher.update(model.data(), model.size() * sizeof(path_t::value_type));
+        hasher.update(noise);
+        hasher.update(scale);
+        hasher.update(tta_mode);
+        hasher.update(&tta_threshold, sizeof(tta_threshold));
+        hasher.update(flat_threshold);
+        hasher.update(keep_alpha);
+        hasher.update(format.data(), format.size() * sizeof(path_t::value_type));
+
+        // every device with its tile size once, however many cpu workers there are
+        std::vector<std::pair<int, int> > devices;
+        for (int i=0; i<use_gpu_count; i++)
+        {
+            devices.push_back(std::make_pair(gpuid[i], tilesize[i]));
+        }
+        std::sort(devices.begin(), devices.end());
+        devices.erase(std::unique(devices.begin(), devices.end()), devices.end());
+
+        for (size_t i=0; i<devices.size(); i++)
+        {
+            hasher.update(devices[i].first);
+            hasher.update(devices[i].second);
+        }
+
+        // band edges follow the measured device speeds, a split image differs from run to run in the tiles near them
+        const long long split_key = use_gpu_count > 1 ? split_pixels : 0;
+        hasher.update(&split_key, sizeof(split_key));
+
+        settings_key = hasher.key();
+    }
+
+    if (!journalpath.empty())
+    {
+        if (!journal.open(journalpath, settings_key))
+        {
+            fprintf(stderr, "invalid journal-path argument\n");
+
+            ncnn::destroy_gpu_instance();
+            return -1;
+        }
+
+        // leave out the inputs finished by earlier runs with the same settings and devices
+        std::vector<path_t> pending_input_files;
+        std::vector<path_t> pending_output_files;
+        for (int i=0; i<(int)input_files.size(); i++)
+        {
+            long long size;
+            long long mtime;
+            if (get_file_stat(input_files[i], &size, &mtime) && journal.is_done(input_files[i], size, mtime, output_files[i]))
+                continue;
+
+            pending_input_files.push_back(input_files[i]);
+            pending_output_files.push_back(output_files[i]);
+        }
+
+        if (verbose)
+        {
+            fprintf(stdout, "journal skips %d / %d inputs\n", (int)(input_files.size() - pending_input_files.size()), (int)input_files.size());
+        }
+
+        input_files.swap(pending_input_files);
+        output_files.swap(pending_output_files);
+    }
+
     {
+        size_t budget = (size_t)max_memory * 1024 * 1024;
+        if (budget == 0)
+        {
+            // half of the machine or of the container memory limit by default
+            budget = get_available_memory() / 2;
+            if (budget == 0)
+                budget = (size_t)4096 * 1024 * 1024;
+        }
+
+        // the tile cache and the tiles in flight on cpu come out of the same budget
+        const size_t tile_cache_bytes = (size_t)tile_cache_size * 1024 * 1024;
+        size_t reserved = tile_cache_bytes;
+        for (int i=0; i<use_gpu_count; i++)
+        {
+            if (gpuid[i] != -1)
+                continue;
+
+            reserved += tile_working_set(tilesize[i], prepadding) * cpu_tiles_in_flight(jobs_proc[i], cpu_tile_threads, tta_mode);
+        }
+
+        // a quarter of the rest stays in the image pool as free buffers for the next images
+        const size_t image_budget = budget > reserved ? budget - reserved : 0;
+        const size_t pool_capacity = image_budget / 4;
+
+        image_pool.set_capacity(pool_capacity);
+        image_pool.set_huge_pages(huge_pages != 0);
+
+        // a task larger than what is left still runs, alone
+        memory_budget.set_budget(image_budget - pool_capacity);
+
+        if (verbose)
+        {
+            fprintf(stdout, "memory budget %lu MB, %lu MB for images in flight, %lu MB of free image buffers\n", (unsigned long)(budget / 1024 / 1024), (unsigned long)((image_budget - pool_capacity) / 1024 / 1024), (unsigned long)(pool_capacity / 1024 / 1024));
+        }
+
+        TileCache* tile_cache = tile_cache_size > 0 ? new TileCache(tile_cache_bytes) : 0;
+
         std::vector<Waifu2x*> waifu2x(use_gpu_count);
 
         for (int i=0; i<use_gpu_count; i++)
@@ -856,30 +2533,71 @@ int main(int argc, char** argv)
 
             waifu2x[i] = new Waifu2x(gpuid[i], tta_mode, num_threads);
 
+            // weights are touched first while loading, load them on the node of the worker
+            const std::vector<int> main_thread_cpus = get_current_thread_cpus();
+            const bool bound = bind_current_thread(device_bind_cpus[i]);
+
             waifu2x[i]->load(paramfullpath, modelfullpath);
 
+            if (bound)
+            {
+                bind_current_thread(main_thread_cpus);
+            }
+
             waifu2x[i]->noise = noise;
             waifu2x[i]->scale = (scale >= 2) ? 2 : scale;
             waifu2x[i]->tilesize = tilesize[i];
             waifu2x[i]->prepadding = prepadding;
+            waifu2x[i]->tile_threads = cpu_tile_threads;
+            waifu2x[i]->tta_threshold = tta_threshold;
+            waifu2x[i]->flat_threshold = flat_threshold;
+            waifu2x[i]->tile_cache = tile_cache;
         }
 
         // main routine
         {
             // load image
+            // decoding and encoding share jobs_load + jobs_save slots, split as the run goes
+            // each side gets threads for every slot it can ever hold, one always stays with the other side
+
+            // no more cpu threads busy at once than there are cores, whatever the stage
+            // set before any thread that takes from it starts
+            core_budget.set_budget(core_count != 0 ? core_count : cpu_count);
+
+            stage_balancer.init(jobs_load, jobs_save, total_jobs_proc);
+
+            const int load_thread_count = stage_balancer.max_limit(StageBalancer::STAGE_LOAD);
+            const int save_thread_count = stage_balancer.max_limit(StageBalancer::STAGE_SAVE);
+
             LoadThreadParams ltp;
             ltp.scale = scale;
-            ltp.jobs_load = jobs_load;
+            ltp.jobs_load = load_thread_count;
+            ltp.verbose = verbose;
+            ltp.keep_alpha = keep_alpha;
+            ltp.cache_dir = cache_dir;
+            ltp.cache_settings = settings_key;
             ltp.input_files = input_files;
             ltp.output_files = output_files;
 
             ncnn::Thread load_thread(load, (void*)&ltp);
 
             // waifu2x proc
+            device_throughput.init(gpuid);
+
+            device_cpu_threads.resize(use_gpu_count);
+            for (int i=0; i<use_gpu_count; i++)
+            {
+                device_cpu_threads[i] = gpuid[i] == -1 ? jobs_proc[i] : 0;
+            }
+
             std::vector<ProcThreadParams> ptp(use_gpu_count);
             for (int i=0; i<use_gpu_count; i++)
             {
                 ptp[i].waifu2x = waifu2x[i];
+                ptp[i].device = i;
+                ptp[i].device_jobs = gpuid[i] == -1 ? 1 : jobs_proc[i];
+                ptp[i].waifu2x_all = waifu2x;
+                ptp[i].split_pixels = split_pixels;
             }
 
             std::vector<ncnn::Thread*> proc_threads(total_jobs_proc);
@@ -904,9 +2622,10 @@ int main(int argc, char** argv)
             // save image
             SaveThreadParams stp;
             stp.verbose = verbose;
+            stp.keep_alpha = keep_alpha;
 
-            std::vector<ncnn::Thread*> save_threads(jobs_save);
-            for (int i=0; i<jobs_save; i++)
+            std::vector<ncnn::Thread*> save_threads(save_thread_count);
+            for (int i=0; i<save_thread_count; i++)
             {
                 save_threads[i] = new ncnn::Thread(save, (void*)&stp);
             }
@@ -914,12 +2633,11 @@ int main(int argc, char** argv)
             // end
             load_thread.join();
 
-            Task end;
-            end.id = -233;
-
             for (int i=0; i<total_jobs_proc; i++)
             {
-                toproc.put(end);
+                Task end;
+                end.id = -233;
+                toproc.put(std::move(end));
             }
 
             for (int i=0; i<total_jobs_proc; i++)
@@ -928,16 +2646,35 @@ int main(int argc, char** argv)
                 delete proc_threads[i];
             }
 
-            for (int i=0; i<jobs_save; i++)
+            // help requests put while the other proc threads were taking their end markers
+            {
+                Task v;
+                while (toproc.try_get(v))
+                {
+                    if (v.id == -1 && v.job->release())
+                        delete v.job;
+                }
+            }
+
+            stage_balancer.finish();
+
+            for (int i=0; i<save_thread_count; i++)
             {
-                tosave.put(end);
+                Task end;
+                end.id = -233;
+                tosave.put(std::move(end));
             }
 
-            for (int i=0; i<jobs_save; i++)
+            for (int i=0; i<save_thread_count; i++)
             {
                 save_threads[i]->join();
                 delete save_threads[i];
             }
+
+            if (verbose)
+            {
+                fprintf(stdout, "load:save threads ended at %d:%d\n", stage_balancer.load_limit(), stage_balancer.save_limit());
+            }
         }
 
         for (int i=0; i<use_gpu_count; i++)
@@ -945,6 +2682,27 @@ int main(int argc, char** argv)
             delete waifu2x[i];
         }
         waifu2x.clear();
+
+        if (tile_cache)
+        {
+            if (verbose)
+            {
+                const size_t hits = tile_cache->hit_count();
+                const size_t lookups = hits + tile_cache->miss_count();
+                fprintf(stdout, "tile cache hit %lu / %lu (%.1f%%)\n", (unsigned long)hits, (unsigned long)lookups, lookups ? hits * 100.0 / lookups : 0.0);
+            }
+
+            delete tile_cache;
+        }
+
+        if (verbose)
+        {
+            const size_t hits = image_pool.hit_count();
+            const size_t allocations = hits + image_pool.miss_count();
+            fprintf(stdout, "image buffers reused %lu / %lu (%.1f%%)\n", (unsigned long)hits, (unsigned long)allocations, allocations ? hits * 100.0 / allocations : 0.0);
+        }
+
+        image_pool.clear();
     }
 
     ncnn::destroy_gpu_instance();
@@ -7,6 +7,9 @@
 #include <stdlib.h>
 #include "png.h"
 
+// ncnn
+#include "allocator.h"
+
 struct png_read_context
 {
     const unsigned char* indata;
@@ -24,12 +27,15 @@ static void png_read_fn(png_structp png_ptr, png_bytep dst, png_size_t nread)
     prc->current += nread;
 }
 
-unsigned char* png_load(const unsigned char* buffer, int len, int* w, int* h, int* c)
+// pixel data comes from allocator when given, malloc otherwise
+unsigned char* png_load(const unsigned char* buffer, int len, int* w, int* h, int* c, ncnn::Allocator* allocator = 0)
 {
     if (len < 8 || png_sig_cmp(buffer, 0, 8))
         return NULL;
 
-    unsigned char* pixeldata = 0;
+    // volatile, so the error path below sees what was allocated before the longjmp
+    unsigned char* volatile pixeldata = 0;
+    png_bytepp volatile row_pointers = 0;
 
     png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr)
@@ -44,6 +50,14 @@ unsigned char* png_load(const unsigned char* buffer, int len, int* w, int* h, in
 
     if (setjmp(png_jmpbuf(png_ptr)))
     {
+        delete[] row_pointers;
+        if (pixeldata)
+        {
+            if (allocator)
+                allocator->fastFree(pixeldata);
+            else
+                free(pixeldata);
+        }
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return NULL;
     }
@@ -85,9 +99,15 @@ unsigned char* png_load(const unsigned char* buffer, int len, int* w, int* h, in
 
     int channels = has_alpha ? 4 : 3;
 
-    pixeldata = (unsigned char*)malloc(width * height * channels);
+    const size_t size = (size_t)width * height * channels;
+    pixeldata = (unsigned char*)(allocator ? allocator->fastMalloc(size) : malloc(size));
+    if (!pixeldata)
+    {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return NULL;
+    }
 
-    png_bytepp row_pointers = new png_bytep[height];
+    row_pointers = new png_bytep[height];
     for (png_uint_32 i = 0; i < height; i++)
         row_pointers[i] = pixeldata + (size_t)i * width * channels;
 
@@ -96,6 +116,7 @@ unsigned char* png_load(const unsigned char* buffer, int len, int* w, int* h, in
     png_read_end(png_ptr, info_ptr);
 
     delete[] row_pointers;
+    row_pointers = 0;
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
@@ -0,0 +1,258 @@
+// waifu2x implemented with ncnn library
+
+#ifndef RESOURCE_UTILS_H
+#define RESOURCE_UTILS_H
+
+// cpu and memory actually available to this process, container limits included
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if _WIN32
+#include <windows.h>
+#else // _WIN32
+#include <unistd.h>
+#endif // _WIN32
+
+#if __linux__
+#include <sched.h>
+#endif // __linux__
+
+// ncnn
+#include "cpu.h"
+
+#if __linux__
+// first line of a small control file, false when missing
+static bool read_control_file(const char* path, char* buf, int size)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    const bool ok = fgets(buf, size, fp) != 0;
+    fclose(fp);
+
+    return ok;
+}
+
+// cpu quota of the cgroup in cores rounded up, 0 for no quota
+// cgroup v2 cpu.max holds "quota period" or "max period", v1 has cfs_quota_us of -1 for none
+static int get_cgroup_cpu_quota()
+{
+    char buf[256];
+
+    if (read_control_file("/sys/fs/cgroup/cpu.max", buf, sizeof(buf)))
+    {
+        long long quota;
+        long long period;
+        if (sscanf(buf, "%lld %lld", &quota, &period) != 2 || quota <= 0 || period <= 0)
+            return 0;
+
+        return (int)((quota + period - 1) / period);
+    }
+
+    static const char* v1_dirs[] = {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpuacct,cpu"};
+    for (int i = 0; i < 3; i++)
+    {
+        char path[256];
+        long long quota = 0;
+        long long period = 0;
+
+        sprintf(path, "%s/cpu.cfs_quota_us", v1_dirs[i]);
+        if (!read_control_file(path, buf, sizeof(buf)) || sscanf(buf, "%lld", &quota) != 1)
+            continue;
+
+        sprintf(path, "%s/cpu.cfs_period_us", v1_dirs[i]);
+        if (!read_control_file(path, buf, sizeof(buf)) || sscanf(buf, "%lld", &period) != 1)
+            continue;
+
+        if (quota <= 0 || period <= 0)
+            return 0;
+
+        return (int)((quota + period - 1) / period);
+    }
+
+    return 0;
+}
+
+// memory limit of the cgroup in bytes, 0 for none
+static size_t get_cgroup_memory_limit()
+{
+    char buf[256];
+
+    // "max" for none
+    if (read_control_file("/sys/fs/cgroup/memory.max", buf, sizeof(buf)))
+    {
+        unsigned long long limit;
+        if (sscanf(buf, "%llu", &limit) != 1)
+            return 0;
+
+        return (size_t)limit;
+    }
+
+    // a page aligned huge number for none
+    if (read_control_file("/sys/fs/cgroup/memory/memory.limit_in_bytes", buf, sizeof(buf)))
+    {
+        unsigned long long limit;
+        if (sscanf(buf, "%llu", &limit) != 1 || limit >= (1ull << 60))
+            return 0;
+
+        return (size_t)limit;
+    }
+
+    return 0;
+}
+#endif // __linux__
+
+// cores this process may run on, the cpuset and the cgroup cpu quota taken into account
+static int get_available_cpu_count()
+{
+    int count = ncnn::get_cpu_count();
+
+#if __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        const int affinity_count = CPU_COUNT(&mask);
+        if (affinity_count > 0 && affinity_count < count)
+            count = affinity_count;
+    }
+
+    const int quota = get_cgroup_cpu_quota();
+    if (quota > 0 && quota < count)
+        count = quota;
+#endif // __linux__
+
+    return count > 1 ? count : 1;
+}
+
+// physical memory, or the cgroup memory limit when lower, 0 when unknown
+static size_t get_available_memory()
+{
+    size_t memory = 0;
+
+#if _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        memory = (size_t)status.ullTotalPhys;
+#else // _WIN32
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pagesize > 0)
+        memory = (size_t)pages * pagesize;
+#endif // _WIN32
+
+#if __linux__
+    const size_t limit = get_cgroup_memory_limit();
+    if (limit > 0 && (memory == 0 || limit < memory))
+        memory = limit;
+#endif // __linux__
+
+    return memory;
+}
+
+// cpus of each numa node this process may run on, empty without numa information or with a single node
+static std::vector<std::vector<int> > get_numa_node_cpus()
+{
+    std::vector<std::vector<int> > nodes;
+
+#if __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+        return nodes;
+
+    for (int node = 0; ; node++)
+    {
+        char path[256];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+
+        // cpu ranges such as 0-15,32-47
+        char buf[1024];
+        if (!read_control_file(path, buf, sizeof(buf)))
+            break;
+
+        std::vector<int> cpus;
+        const char* p = buf;
+        while (*p >= '0' && *p <= '9')
+        {
+            int first = 0;
+            int last = 0;
+            int n = 0;
+            if (sscanf(p, "%d-%d%n", &first, &last, &n) != 2)
+            {
+                n = 0;
+                if (sscanf(p, "%d%n", &first, &n) != 1)
+                    break;
+                last = first;
+            }
+
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &mask))
+                    cpus.push_back(cpu);
+            }
+
+            p += n;
+            if (*p == ',')
+                p++;
+        }
+
+        // nodes without cpus are memory only
+        if (!cpus.empty())
+            nodes.push_back(cpus);
+    }
+
+    if (nodes.size() < 2)
+        nodes.clear();
+#endif // __linux__
+
+    return nodes;
+}
+
+// cpus the calling thread may run on, empty when unknown
+static std::vector<int> get_current_thread_cpus()
+{
+    std::vector<int> cpus;
+
+#if __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &mask))
+                cpus.push_back(cpu);
+        }
+    }
+#endif // __linux__
+
+    return cpus;
+}
+
+// run the calling thread on these cpus only, threads it creates afterwards inherit that
+// memory it touches first then comes from the node of those cpus
+static bool bind_current_thread(const std::vector<int>& cpus)
+{
+#if __linux__
+    if (cpus.empty())
+        return false;
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        CPU_SET(cpus[i], &mask);
+    }
+
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+#else // __linux__
+    (void)cpus;
+    return false;
+#endif // __linux__
+}
+
+#endif // RESOURCE_UTILS_H
@@ -4,13 +4,381 @@
 
 #include <algorithm>
 #include <vector>
+#include <string.h>
 
 #include "waifu2x_preproc.comp.hex.h"
 #include "waifu2x_postproc.comp.hex.h"
 #include "waifu2x_preproc_tta.comp.hex.h"
 #include "waifu2x_postproc_tta.comp.hex.h"
+#include "waifu2x_tta_diff.comp.hex.h"
 
-Waifu2x::Waifu2x(int gpuid, bool _tta_mode, int num_threads)
+#include "waifu2x_cpu.h"
+
+// the tta transforms run for tta_count as bits, numbered as in waifu2x_preproc_tta.comp
+// 2 is identity and hflip, 4 the rotations
+static int tta_transform_mask(int tta_count)
+{
+    if (tta_count == 2)
+        return 0x03;
+
+    if (tta_count == 4)
+        return 0xa5;
+
+    return 0xff;
+}
+
+// the first two transforms of tta_mask, adaptive tta runs them before the others
+static int tta_pair_mask(int tta_mask)
+{
+    int pair_mask = 0;
+    for (int ti = 0, n = 0; ti < 8 && n < 2; ti++)
+    {
+        if (tta_mask & (1 << ti))
+        {
+            pair_mask |= 1 << ti;
+            n++;
+        }
+    }
+
+    return pair_mask;
+}
+
+// the largest 8bit level range of any channel over the [x0, x1) x [y0, y1) region
+static int tile_level_range(const unsigned char* pixeldata, int w, int channels, int x0, int y0, int x1, int y1)
+{
+    unsigned char vmin[4] = {255, 255, 255, 255};
+    unsigned char vmax[4] = {0, 0, 0, 0};
+
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char* ptr = pixeldata + ((size_t)y * w + x0) * channels;
+
+        for (int x = x0; x < x1; x++)
+        {
+            for (int q = 0; q < channels; q++)
+            {
+                vmin[q] = std::min(vmin[q], ptr[q]);
+                vmax[q] = std::max(vmax[q], ptr[q]);
+            }
+
+            ptr += channels;
+        }
+    }
+
+    int range = 0;
+    for (int q = 0; q < channels; q++)
+    {
+        range = std::max(range, vmax[q] - vmin[q]);
+    }
+
+    return range;
+}
+
+// copy the tile_w x tile_h region at x0,y0 of the image with row stride out of or into contiguous data
+static void tile_copy_out(const unsigned char* imagedata, size_t stride, int channels, int x0, int y0, int tile_w, int tile_h, std::vector<unsigned char>& data)
+{
+    const size_t rowsize = (size_t)tile_w * channels;
+
+    data.resize(rowsize * tile_h);
+
+    for (int y = 0; y < tile_h; y++)
+    {
+        memcpy(&data[rowsize * y], imagedata + (size_t)(y0 + y) * stride + (size_t)x0 * channels, rowsize);
+    }
+}
+
+static void tile_copy_in(const std::vector<unsigned char>& data, int channels, int x0, int y0, int tile_w, int tile_h, unsigned char* imagedata, size_t stride)
+{
+    const size_t rowsize = (size_t)tile_w * channels;
+
+    for (int y = 0; y < tile_h; y++)
+    {
+        memcpy(imagedata + (size_t)(y0 + y) * stride + (size_t)x0 * channels, &data[rowsize * y], rowsize);
+    }
+}
+
+// nearest upscale of the tile_w x tile_h region at x0,y0 into the same region of the scale times larger outimage
+static void tile_upscale_nearest(const unsigned char* pixeldata, int w, int channels, int scale, int x0, int y0, int tile_w, int tile_h, unsigned char* outdata)
+{
+    const size_t outstride = (size_t)w * scale * channels;
+
+    for (int y = 0; y < tile_h; y++)
+    {
+        const unsigned char* ptr = pixeldata + ((size_t)(y0 + y) * w + x0) * channels;
+        unsigned char* outptr = outdata + (size_t)(y0 + y) * scale * outstride + (size_t)x0 * scale * channels;
+
+        for (int x = 0; x < tile_w; x++)
+        {
+            for (int sx = 0; sx < scale; sx++)
+            {
+                memcpy(outptr, ptr, channels);
+                outptr += channels;
+            }
+
+            ptr += channels;
+        }
+
+        // the other rows of the pixel repeat the first
+        for (int sy = 1; sy < scale; sy++)
+        {
+            memcpy(outdata + ((size_t)(y0 + y) * scale + sy) * outstride + (size_t)x0 * scale * channels, outdata + (size_t)(y0 + y) * scale * outstride + (size_t)x0 * scale * channels, (size_t)tile_w * scale * channels);
+        }
+    }
+}
+
+// whether the alpha of every pixel in the [x0, x1) x [y0, y1) region of rgba pixeldata is zero
+static bool tile_transparent(const unsigned char* pixeldata, int w, int x0, int y0, int x1, int y1)
+{
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char* ptr = pixeldata + ((size_t)y * w + x0) * 4;
+
+        unsigned char a = 0;
+        for (int x = x0; x < x1; x++)
+        {
+            a |= ptr[3];
+            ptr += 4;
+        }
+
+        if (a)
+            return false;
+    }
+
+    return true;
+}
+
+// allocators and tile buffers of one cpu tile in flight
+// a tile is driven by one thread, only its workspace is also touched by the openmp team of the layers
+// pooled blocks and the buffers below keep their pages from tile to tile, most tiles have the same shape
+class Waifu2xCpuArena
+{
+public:
+    ncnn::UnlockedPoolAllocator blob_allocator;
+    ncnn::PoolAllocator workspace_allocator;
+
+    // one pair per tta variant, the variants of a tile run concurrently
+    ncnn::UnlockedPoolAllocator tta_blob_allocators[8];
+    ncnn::PoolAllocator tta_workspace_allocators[8];
+
+    ncnn::Mat in_tile[8];
+    ncnn::Mat in_alpha_tile;
+    ncnn::Mat merged;
+    ncnn::Mat merge_workspace;
+};
+
+// hands the arena back once the tile released every blob of its pools, declare it before those blobs
+class Waifu2xCpuArenaGuard
+{
+public:
+    Waifu2xCpuArenaGuard(const Waifu2x* _waifu2x) : waifu2x(_waifu2x)
+    {
+        arena = waifu2x->acquire_cpu_arena();
+    }
+
+    ~Waifu2xCpuArenaGuard()
+    {
+        waifu2x->reclaim_cpu_arena(arena);
+    }
+
+    const Waifu2x* waifu2x;
+    Waifu2xCpuArena* arena;
+};
+
+class ParallelTask
+{
+public:
+    virtual ~ParallelTask() {}
+    virtual void run(int i) = 0;
+};
+
+// one Waifu2xThreadPool::run call, open to helpers while wanted is above 0
+class ParallelBatch
+{
+public:
+    ParallelTask* task;
+    int count;
+    int next;
+    int wanted;
+    int active;
+};
+
+// threads of one cpu instance, kept from tile to tile and image to image
+// the caller of run always works through its own batch and idle threads join it as helpers
+// so a run nested in a task, the tta variants of a tile, never waits for a thread busy elsewhere
+class Waifu2xThreadPool
+{
+public:
+    Waifu2xThreadPool();
+    ~Waifu2xThreadPool();
+
+    // run task for [0, count) on up to jobs threads, the calling thread takes part as well
+    // every thread is a plain thread with its own ncnn openmp thread team
+    void run(ParallelTask& task, int count, int jobs);
+
+private:
+    static void* worker(void* args);
+
+    // next index of the batch, -1 when all are taken, with the lock held
+    static int take(ParallelBatch* batch);
+
+private:
+    std::vector<ncnn::Thread*> threads;
+    std::vector<ParallelBatch*> batches;
+    int idle;
+    int wanted;
+    bool stop;
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    ncnn::ConditionVariable finished;
+};
+
+Waifu2xThreadPool::Waifu2xThreadPool()
+{
+    idle = 0;
+    wanted = 0;
+    stop = false;
+}
+
+Waifu2xThreadPool::~Waifu2xThreadPool()
+{
+    lock.lock();
+    stop = true;
+    lock.unlock();
+
+    condition.broadcast();
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+}
+
+void Waifu2xThreadPool::run(ParallelTask& task, int count, int jobs)
+{
+    jobs = std::min(jobs, count);
+
+    if (jobs <= 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            task.run(i);
+        }
+        return;
+    }
+
+    ParallelBatch batch;
+    batch.task = &task;
+    batch.count = count;
+    batch.next = 0;
+    batch.wanted = jobs - 1;
+    batch.active = 0;
+
+    lock.lock();
+
+    batches.push_back(&batch);
+    wanted += batch.wanted;
+
+    // threads are created on first need and stay, as many as the busiest moment asked for
+    // they start from the calling proc thread and inherit its cpu binding
+    while (idle < wanted)
+    {
+        idle++;
+        threads.push_back(new ncnn::Thread(worker, (void*)this));
+    }
+
+    lock.unlock();
+
+    condition.broadcast();
+
+    for (;;)
+    {
+        lock.lock();
+        const int i = take(&batch);
+        lock.unlock();
+
+        if (i == -1)
+            break;
+
+        task.run(i);
+    }
+
+    lock.lock();
+
+    // no helper joins a batch that is done, then wait for those still on its last items
+    std::vector<ParallelBatch*>::iterator it = std::find(batches.begin(), batches.end(), &batch);
+    if (it != batches.end())
+    {
+        batches.erase(it);
+        wanted -= batch.wanted;
+    }
+
+    while (batch.active > 0)
+    {
+        finished.wait(lock);
+    }
+
+    lock.unlock();
+}
+
+void* Waifu2xThreadPool::worker(void* args)
+{
+    Waifu2xThreadPool* pool = (Waifu2xThreadPool*)args;
+
+    pool->lock.lock();
+
+    for (;;)
+    {
+        while (!pool->stop && pool->batches.empty())
+        {
+            pool->condition.wait(pool->lock);
+        }
+
+        if (pool->stop)
+            break;
+
+        ParallelBatch* batch = pool->batches.front();
+        batch->wanted--;
+        pool->wanted--;
+        if (batch->wanted == 0)
+            pool->batches.erase(pool->batches.begin());
+
+        batch->active++;
+        pool->idle--;
+
+        for (;;)
+        {
+            const int i = take(batch);
+            if (i == -1)
+                break;
+
+            pool->lock.unlock();
+            batch->task->run(i);
+            pool->lock.lock();
+        }
+
+        batch->active--;
+        pool->idle++;
+
+        if (batch->active == 0)
+            pool->finished.broadcast();
+    }
+
+    pool->lock.unlock();
+
+    return 0;
+}
+
+int Waifu2xThreadPool::take(ParallelBatch* batch)
+{
+    if (batch->next >= batch->count)
+        return -1;
+
+    return batch->next++;
+}
+
+Waifu2x::Waifu2x(int gpuid, int _tta_mode, int num_threads)
 {
     vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
 
@@ -18,8 +386,20 @@ Waifu2x::Waifu2x(int gpuid, bool _tta_mode, int num_threads)
 
     waifu2x_preproc = 0;
     waifu2x_postproc = 0;
+    waifu2x_postproc_pair = 0;
+    waifu2x_tta_diff = 0;
     bicubic_2x = 0;
     tta_mode = _tta_mode;
+
+    tile_threads = 0;
+    tta_threshold = 0.f;
+    flat_threshold = -1;
+    tile_cache = 0;
+
+    model_key.h0 = 0;
+    model_key.h1 = 0;
+
+    cpu_thread_pool = vkdev ? 0 : new Waifu2xThreadPool;
 }
 
 Waifu2x::~Waifu2x()
@@ -28,10 +408,19 @@ Waifu2x::~Waifu2x()
     {
         delete waifu2x_preproc;
         delete waifu2x_postproc;
+        delete waifu2x_postproc_pair;
+        delete waifu2x_tta_diff;
     }
 
     bicubic_2x->destroy_pipeline(net.opt);
     delete bicubic_2x;
+
+    delete cpu_thread_pool;
+
+    for (size_t i = 0; i < cpu_arenas.size(); i++)
+    {
+        delete cpu_arenas[i];
+    }
 }
 
 #if _WIN32
@@ -48,6 +437,13 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath)
 
     net.set_vulkan_device(vkdev);
 
+    {
+        TileHasher hasher;
+        hasher.update(parampath.data(), parampath.size() * sizeof(parampath[0]));
+        hasher.update(modelpath.data(), modelpath.size() * sizeof(modelpath[0]));
+        model_key = hasher.key();
+    }
+
 #if _WIN32
     {
         FILE* fp = _wfopen(parampath.c_str(), L"rb");
@@ -79,12 +475,13 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath)
     // initialize preprocess and postprocess pipeline
     if (vkdev)
     {
-        std::vector<ncnn::vk_specialization_type> specializations(1);
+        std::vector<ncnn::vk_specialization_type> specializations(2);
 #if _WIN32
         specializations[0].i = 1;
 #else
         specializations[0].i = 0;
 #endif
+        specializations[1].i = tta_transform_mask(tta_mode);
 
         {
             static std::vector<uint32_t> spirv;
@@ -123,6 +520,55 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath)
             waifu2x_postproc->set_optimal_local_size_xyz(8, 8, 3);
             waifu2x_postproc->create(spirv.data(), spirv.size() * 4, specializations);
         }
+
+        // adaptive tta merges the first pair alone when the rest is skipped
+        if (tta_mode > 2)
+        {
+            const int pair_mask = tta_pair_mask(tta_transform_mask(tta_mode));
+
+            std::vector<ncnn::vk_specialization_type> pair_specializations = specializations;
+            pair_specializations[1].i = pair_mask;
+
+            {
+                static std::vector<uint32_t> spirv;
+                static ncnn::Mutex lock;
+                {
+                    ncnn::MutexLockGuard guard(lock);
+                    if (spirv.empty())
+                    {
+                        compile_spirv_module(waifu2x_postproc_tta_comp_data, sizeof(waifu2x_postproc_tta_comp_data), net.opt, spirv);
+                    }
+                }
+
+                waifu2x_postproc_pair = new ncnn::Pipeline(vkdev);
+                waifu2x_postproc_pair->set_optimal_local_size_xyz(8, 8, 3);
+                waifu2x_postproc_pair->create(spirv.data(), spirv.size() * 4, pair_specializations);
+            }
+
+            {
+                // the pair is transform 0 and one flip of it
+                int pair_transform = 1;
+                while (!(pair_mask & (1 << pair_transform)))
+                    pair_transform++;
+
+                std::vector<ncnn::vk_specialization_type> diff_specializations(1);
+                diff_specializations[0].i = pair_transform;
+
+                static std::vector<uint32_t> spirv;
+                static ncnn::Mutex lock;
+                {
+                    ncnn::MutexLockGuard guard(lock);
+                    if (spirv.empty())
+                    {
+                        compile_spirv_module(waifu2x_tta_diff_comp_data, sizeof(waifu2x_tta_diff_comp_data), net.opt, spirv);
+                    }
+                }
+
+                waifu2x_tta_diff = new ncnn::Pipeline(vkdev);
+                waifu2x_tta_diff->set_optimal_local_size_xyz(8, 8, 3);
+                waifu2x_tta_diff->create(spirv.data(), spirv.size() * 4, diff_specializations);
+            }
+        }
     }
 
     // bicubic 2x for alpha channel
@@ -142,27 +588,165 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath)
     return 0;
 }
 
-int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+bool Waifu2x::tile_skips_model(const ncnn::Mat& inimage, int xi, int row_y0, int row_y1, int prepadding_right, int prepadding_bottom) const
 {
-    if (!vkdev)
+    const unsigned char* pixeldata = (const unsigned char*)inimage.data;
+    const int w = inimage.w;
+    const int h = inimage.h;
+    const int channels = inimage.elempack;
+
+    const int TILE_SIZE_X = tile_size(w);
+
+    const int tile_x0 = xi * TILE_SIZE_X;
+    const int tile_y0 = row_y0;
+    const int tile_x1 = std::min(tile_x0 + TILE_SIZE_X, w);
+    const int tile_y1 = row_y1;
+
+    // the rgb of a fully transparent tile is invisible, the bicubic alpha stays zero
+    if (channels == 4 && tile_transparent(pixeldata, w, tile_x0, tile_y0, tile_x1, tile_y1))
+        return true;
+
+    // flat tile, padding included
+    if (flat_threshold >= 0)
     {
-        // cpu only
-        return process_cpu(inimage, outimage);
+        const int x0 = std::max(tile_x0 - prepadding, 0);
+        const int y0 = std::max(tile_y0 - prepadding, 0);
+        const int x1 = std::min(tile_x1 + prepadding_right, w);
+        const int y1 = std::min(tile_y1 + prepadding_bottom, h);
+
+        if (tile_level_range(pixeldata, w, channels, x0, y0, x1, y1) <= flat_threshold)
+            return true;
     }
 
+    return false;
+}
+
+TileCacheKey Waifu2x::tile_cache_key(const ncnn::Mat& inimage, int xi, int row_y0, int row_y1, int prepadding_right, int prepadding_bottom) const
+{
+    const unsigned char* pixeldata = (const unsigned char*)inimage.data;
+    const int w = inimage.w;
+    const int h = inimage.h;
+    const int channels = inimage.elempack;
+
+    const int TILE_SIZE_X = tile_size(w);
+
+    // the padded tile, border replicate makes it a function of the clamped region and the padding outside the image
+    const int x0 = xi * TILE_SIZE_X - prepadding;
+    const int y0 = row_y0 - prepadding;
+    const int x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
+    const int y1 = row_y1 + prepadding_bottom;
+
+    const int cx0 = std::max(x0, 0);
+    const int cy0 = std::max(y0, 0);
+    const int cx1 = std::min(x1, w);
+    const int cy1 = std::min(y1, h);
+
+    TileHasher hasher;
+
+    hasher.update(&model_key, sizeof(model_key));
+    hasher.update(noise);
+    hasher.update(scale);
+    hasher.update(prepadding);
+    hasher.update(tta_mode);
+    hasher.update(&tta_threshold, sizeof(tta_threshold));
+    hasher.update(channels);
+
+    // the cache is shared by all instances, cpu fp32 and gpu fp16 storage or arithmetic give different pixels
+    // and so may two gpus, the device is part of the key, it lives as long as the cache
+    const uint64_t device = (uint64_t)(size_t)vkdev;
+    hasher.update(&device, sizeof(device));
+    hasher.update(net.opt.use_fp16_packed);
+    hasher.update(net.opt.use_fp16_storage);
+    hasher.update(net.opt.use_fp16_arithmetic);
+    hasher.update(net.opt.use_int8_storage);
+
+    hasher.update(cx0 - x0);
+    hasher.update(cy0 - y0);
+    hasher.update(x1 - cx1);
+    hasher.update(y1 - cy1);
+    hasher.update(cx1 - cx0);
+    hasher.update(cy1 - cy0);
+
+    for (int y = cy0; y < cy1; y++)
+    {
+        hasher.update(pixeldata + ((size_t)y * w + cx0) * channels, (size_t)(cx1 - cx0) * channels);
+    }
+
+    return hasher.key();
+}
+
+int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+{
     if (noise == -1 && scale == 1)
     {
         outimage = inimage;
         return 0;
     }
 
+    return process_rows(inimage, outimage, 0, tile_rows(inimage));
+}
+
+int Waifu2x::process_band(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1) const
+{
+    if (noise == -1 && scale == 1)
+    {
+        const size_t stride = (size_t)inimage.w * inimage.elempack;
+        if (outimage.data != inimage.data)
+            memcpy((unsigned char*)outimage.data + y0 * stride, (const unsigned char*)inimage.data + y0 * stride, (y1 - y0) * stride);
+        return 0;
+    }
+
+    const int TILE_SIZE_Y = tile_size(y1 - y0);
+
+    return process_tile_rows(inimage, outimage, y0, y1, 0, (y1 - y0 + TILE_SIZE_Y - 1) / TILE_SIZE_Y);
+}
+
+int Waifu2x::tile_rows(const ncnn::Mat& inimage) const
+{
+    if (noise == -1 && scale == 1)
+        return 0;
+
+    const int TILE_SIZE_Y = tile_size(inimage.h);
+
+    return (inimage.h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+}
+
+int Waifu2x::tile_size(int length) const
+{
+    // the model takes tiles of a multiple of 4 at scale 1 and of 2 at scale 2, then only the last tile is padded up
+    const int align = scale == 1 ? 4 : 2;
+    const int max_size = std::max(tilesize / align * align, align);
+
+    // the fewest tiles within tilesize, every extra tile pays the prepadding halo again
+    const int count = (length + max_size - 1) / max_size;
+    const int size = (length + count - 1) / count;
+
+    return (size + align - 1) / align * align;
+}
+
+int Waifu2x::process_rows(const ncnn::Mat& inimage, ncnn::Mat& outimage, int yi0, int yi1) const
+{
+    return process_tile_rows(inimage, outimage, 0, inimage.h, yi0, yi1);
+}
+
+int Waifu2x::process_tile_rows(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1, int yi0, int yi1) const
+{
+    if (!vkdev)
+    {
+        // cpu only
+        return process_cpu(inimage, outimage, y0, y1, yi0, yi1);
+    }
+
+    if (noise == -1 && scale == 1)
+        return 0;
+
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    const int TILE_SIZE_X = tile_size(w);
+    const int TILE_SIZE_Y = tile_size(y1 - y0);
 
     ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
     ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
@@ -172,16 +756,19 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
     opt.workspace_vkallocator = blob_vkallocator;
     opt.staging_vkallocator = staging_vkallocator;
 
-    // each tile 400x400
+    // each tile up to 400x400
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
     const size_t in_out_tile_elemsize = (opt.use_fp16_storage || opt.use_fp16_packed) ? 2u : 4u;
 
     //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    for (int yi = yi0; yi < yi1; yi++)
     {
-        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+        // the rows of this tile row, the rows around them up to the image border are model context
+        const int row_y0 = y0 + yi * TILE_SIZE_Y;
+        const int row_y1 = std::min(row_y0 + TILE_SIZE_Y, y1);
+
+        const int tile_h_nopad = row_y1 - row_y0;
 
         int prepadding_bottom = prepadding;
         if (scale == 1)
@@ -193,8 +780,8 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
             prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
         }
 
-        int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
-        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
+        int in_tile_y0 = std::max(row_y0 - prepadding, 0);
+        int in_tile_y1 = std::min(row_y1 + prepadding_bottom, h);
 
         ncnn::Mat in;
         if ((opt.use_fp16_storage || opt.use_fp16_packed) && opt.use_int8_storage)
@@ -235,8 +822,14 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
             }
         }
 
-        int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
-        int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h);
+        int out_tile_y0 = row_y0;
+        int out_tile_y1 = row_y1;
+
+        std::vector<int> flat_tiles;
+        std::vector<int> cached_tiles;
+        std::vector<std::vector<unsigned char> > cached_tile_data;
+        std::vector<int> computed_tiles;
+        std::vector<TileCacheKey> computed_tile_keys;
 
         ncnn::VkMat out_gpu;
         if ((opt.use_fp16_storage || opt.use_fp16_packed) && opt.use_int8_storage)
@@ -262,6 +855,31 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                 prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
             }
 
+            // flat or fully transparent tile, no inference, filled after the download
+            if (tile_skips_model(inimage, xi, row_y0, row_y1, prepadding_right, prepadding_bottom))
+            {
+                flat_tiles.push_back(xi);
+                continue;
+            }
+
+            // cached tile, filled after the download
+            if (tile_cache)
+            {
+                const TileCacheKey tile_key = tile_cache_key(inimage, xi, row_y0, row_y1, prepadding_right, prepadding_bottom);
+
+                std::vector<unsigned char> tile_data;
+                if (tile_cache->get(tile_key, tile_data))
+                {
+                    cached_tiles.push_back(xi);
+                    cached_tile_data.push_back(std::vector<unsigned char>());
+                    cached_tile_data.back().swap(tile_data);
+                    continue;
+                }
+
+                computed_tiles.push_back(xi);
+                computed_tile_keys.push_back(tile_key);
+            }
+
             if (tta_mode)
             {
                 // preproc
@@ -271,17 +889,21 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     // crop tile
                     int tile_x0 = xi * TILE_SIZE_X - prepadding;
                     int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
-
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                    int tile_y0 = row_y0 - prepadding;
+                    int tile_y1 = row_y1 + prepadding_bottom;
+
+                    // transforms left out by the tta count stay empty
+                    const int tta_mask = tta_transform_mask(tta_mode);
+                    for (int ti = 0; ti < 8; ti++)
+                    {
+                        if (!(tta_mask & (1 << ti)))
+                            continue;
+
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                    }
 
                     if (channels == 4)
                     {
@@ -310,7 +932,7 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     constants[6].i = prepadding;
                     constants[7].i = prepadding;
                     constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
+                    constants[9].i = std::min(row_y0, prepadding);
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
@@ -323,10 +945,23 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
                 }
 
-                // waifu2x
+                // waifu2x
+                int transforms[8];
+                int transform_count = 0;
+                for (int ti = 0; ti < 8; ti++)
+                {
+                    if (!in_tile_gpu[ti].empty())
+                        transforms[transform_count++] = ti;
+                }
+
+                // adaptive tta runs the first pair alone and stops there when the two agree
+                int transform_done = (tta_threshold > 0.f && transform_count > 2) ? 2 : transform_count;
+
                 ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int i = 0; i < transform_done; i++)
                 {
+                    const int ti = transforms[i];
+
                     ncnn::Extractor ex = net.create_extractor();
 
                     ex.set_blob_vkallocator(blob_vkallocator);
@@ -338,6 +973,64 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     ex.extract("Eltwise4", out_tile_gpu[ti], cmd);
                 }
 
+                if (transform_done < transform_count)
+                {
+                    // mean difference of the pair in 8bit levels, read back before deciding
+                    ncnn::Mat diff_zero(1, (size_t)4u);
+                    ((unsigned int*)diff_zero.data)[0] = 0;
+
+                    ncnn::VkMat diff_gpu;
+                    cmd.record_clone(diff_zero, diff_gpu, opt);
+
+                    std::vector<ncnn::VkMat> bindings(3);
+                    bindings[0] = out_tile_gpu[transforms[0]];
+                    bindings[1] = out_tile_gpu[transforms[1]];
+                    bindings[2] = diff_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(5);
+                    constants[0].i = out_tile_gpu[0].w;
+                    constants[1].i = out_tile_gpu[0].h;
+                    constants[2].i = out_tile_gpu[0].cstep;
+                    constants[3].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
+                    constants[4].i = out_gpu.h;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = constants[3].i;
+                    dispatcher.h = constants[4].i;
+                    dispatcher.c = 3;
+
+                    cmd.record_pipeline(waifu2x_tta_diff, bindings, constants, dispatcher);
+
+                    ncnn::Mat diff;
+                    cmd.record_clone(diff_gpu, diff, opt);
+
+                    cmd.submit_and_wait();
+                    cmd.reset();
+
+                    // the shader sums in 1/8 levels
+                    const float tta_diff = ((const unsigned int*)diff.data)[0] / 8.f / ((float)dispatcher.w * dispatcher.h * 3);
+
+                    if (tta_diff >= tta_threshold)
+                    {
+                        for (int i = transform_done; i < transform_count; i++)
+                        {
+                            const int ti = transforms[i];
+
+                            ncnn::Extractor ex = net.create_extractor();
+
+                            ex.set_blob_vkallocator(blob_vkallocator);
+                            ex.set_workspace_vkallocator(blob_vkallocator);
+                            ex.set_staging_vkallocator(staging_vkallocator);
+
+                            ex.input("Input1", in_tile_gpu[ti]);
+
+                            ex.extract("Eltwise4", out_tile_gpu[ti], cmd);
+                        }
+
+                        transform_done = transform_count;
+                    }
+                }
+
                 ncnn::VkMat out_alpha_tile_gpu;
                 if (channels == 4)
                 {
@@ -383,7 +1076,7 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     dispatcher.h = out_gpu.h;
                     dispatcher.c = channels;
 
-                    cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+                    cmd.record_pipeline(transform_done < transform_count ? waifu2x_postproc_pair : waifu2x_postproc, bindings, constants, dispatcher);
                 }
             }
             else
@@ -395,8 +1088,8 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     // crop tile
                     int tile_x0 = xi * TILE_SIZE_X - prepadding;
                     int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
+                    int tile_y0 = row_y0 - prepadding;
+                    int tile_y1 = row_y1 + prepadding_bottom;
 
                     in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
 
@@ -420,7 +1113,7 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     constants[6].i = prepadding;
                     constants[7].i = prepadding;
                     constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
+                    constants[9].i = std::min(row_y0, prepadding);
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
@@ -502,7 +1195,7 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
 
             if ((opt.use_fp16_storage || opt.use_fp16_packed) && opt.use_int8_storage)
             {
-                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels, (size_t)channels, 1, opt.blob_allocator);
+                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + (size_t)row_y0 * scale * w * scale * channels, (size_t)channels, 1, opt.blob_allocator);
             }
 
             cmd.record_clone(out_gpu, out, opt);
@@ -514,21 +1207,49 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                 if (channels == 3)
                 {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB2BGR);
+                    out.to_pixels((unsigned char*)outimage.data + (size_t)row_y0 * scale * w * scale * channels, ncnn::Mat::PIXEL_RGB2BGR);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB);
+                    out.to_pixels((unsigned char*)outimage.data + (size_t)row_y0 * scale * w * scale * channels, ncnn::Mat::PIXEL_RGB);
 #endif
                 }
                 if (channels == 4)
                 {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA2BGRA);
+                    out.to_pixels((unsigned char*)outimage.data + (size_t)row_y0 * scale * w * scale * channels, ncnn::Mat::PIXEL_RGBA2BGRA);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA);
+                    out.to_pixels((unsigned char*)outimage.data + (size_t)row_y0 * scale * w * scale * channels, ncnn::Mat::PIXEL_RGBA);
 #endif
                 }
             }
         }
+
+        // flat and fully transparent tiles
+        for (size_t i = 0; i < flat_tiles.size(); i++)
+        {
+            const int xi = flat_tiles[i];
+            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+            tile_upscale_nearest(pixeldata, w, channels, scale, xi * TILE_SIZE_X, row_y0, tile_w_nopad, tile_h_nopad, (unsigned char*)outimage.data);
+        }
+
+        // cached tiles, and remember the computed ones
+        for (size_t i = 0; i < cached_tiles.size(); i++)
+        {
+            const int xi = cached_tiles[i];
+            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+            tile_copy_in(cached_tile_data[i], channels, xi * TILE_SIZE_X * scale, row_y0 * scale, tile_w_nopad * scale, tile_h_nopad * scale, (unsigned char*)outimage.data, (size_t)w * scale * channels);
+        }
+        for (size_t i = 0; i < computed_tiles.size(); i++)
+        {
+            const int xi = computed_tiles[i];
+            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+            std::vector<unsigned char> tile_data;
+            tile_copy_out((const unsigned char*)outimage.data, (size_t)w * scale * channels, channels, xi * TILE_SIZE_X * scale, row_y0 * scale, tile_w_nopad * scale, tile_h_nopad * scale, tile_data);
+
+            tile_cache->put(computed_tile_keys[i], tile_data);
+        }
     }
 
     vkdev->reclaim_blob_allocator(blob_vkallocator);
@@ -537,345 +1258,344 @@ int Waifu2x::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
     return 0;
 }
 
-int Waifu2x::process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+class Waifu2xCpuTileTask : public ParallelTask
 {
-    if (noise == -1 && scale == 1)
+public:
+    const Waifu2x* waifu2x;
+    const ncnn::Mat* inimage;
+    ncnn::Mat* outimage;
+    const ncnn::Option* opt;
+    int xtiles;
+    int tile_size_y;
+    int y0;
+    int y1;
+    int yi0;
+
+    virtual void run(int i)
     {
-        outimage = inimage;
+        const int row_y0 = y0 + (yi0 + i / xtiles) * tile_size_y;
+        const int row_y1 = std::min(row_y0 + tile_size_y, y1);
+
+        waifu2x->process_cpu_tile(*inimage, *outimage, i % xtiles, row_y0, row_y1, *opt);
+    }
+};
+
+class Waifu2xCpuTtaTask : public ParallelTask
+{
+public:
+    const ncnn::Net* net;
+    const int* transforms;
+    const ncnn::Mat* in_tile;
+    ncnn::Mat* out_tile;
+    ncnn::UnlockedPoolAllocator* blob_allocators;
+    ncnn::PoolAllocator* workspace_allocators;
+    int num_threads;
+
+    virtual void run(int i)
+    {
+        i = transforms[i];
+
+        ncnn::Extractor ex = net->create_extractor();
+
+        ex.set_num_threads(num_threads);
+        ex.set_blob_allocator(&blob_allocators[i]);
+        ex.set_workspace_allocator(&workspace_allocators[i]);
+
+        ex.input("Input1", in_tile[i]);
+
+        ex.extract("Eltwise4", out_tile[i]);
+    }
+};
+
+int Waifu2x::process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1, int yi0, int yi1) const
+{
+    if (noise == -1 && scale == 1)
         return 0;
+
+    const int w = inimage.w;
+
+    const int TILE_SIZE_X = tile_size(w);
+    const int TILE_SIZE_Y = tile_size(y1 - y0);
+
+    // each tile up to 400x400
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = yi1 - yi0;
+
+    // split the thread budget between concurrent tiles and the intra-op threads of each tile
+    // convolution on a single tile hardly scales beyond a few threads
+    int tile_jobs = tile_threads;
+    if (tile_jobs == 0)
+    {
+        tile_jobs = std::max(net.opt.num_threads / 4, 1);
     }
+    tile_jobs = std::max(std::min(tile_jobs, std::min(xtiles * ytiles, net.opt.num_threads)), 1);
+
+    ncnn::Option opt = net.opt;
+    opt.num_threads = std::max(net.opt.num_threads / tile_jobs, 1);
+
+    Waifu2xCpuTileTask task;
+    task.waifu2x = this;
+    task.inimage = &inimage;
+    task.outimage = &outimage;
+    task.opt = &opt;
+    task.xtiles = xtiles;
+    task.tile_size_y = TILE_SIZE_Y;
+    task.y0 = y0;
+    task.y1 = y1;
+    task.yi0 = yi0;
+
+    // rows shared between proc threads come here one at a time, the pool threads stay across them
+    cpu_thread_pool->run(task, xtiles * ytiles, tile_jobs);
+
+    return 0;
+}
 
+int Waifu2x::process_cpu_tile(const ncnn::Mat& inimage, ncnn::Mat& outimage, int xi, int row_y0, int row_y1, const ncnn::Option& opt) const
+{
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    const int TILE_SIZE_X = tile_size(w);
 
-    ncnn::Option opt = net.opt;
+    const int tile_h_nopad = row_y1 - row_y0;
 
-    // each tile 400x400
-    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+    int prepadding_bottom = prepadding;
+    if (scale == 1)
+    {
+        prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
+    }
+    if (scale == 2)
+    {
+        prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
+    }
+
+    const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
 
-    for (int yi = 0; yi < ytiles; yi++)
+    int prepadding_right = prepadding;
+    if (scale == 1)
+    {
+        prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+    }
+    if (scale == 2)
     {
-        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+        prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+    }
 
-        int prepadding_bottom = prepadding;
-        if (scale == 1)
+    // flat or fully transparent tile, no inference
+    if (tile_skips_model(inimage, xi, row_y0, row_y1, prepadding_right, prepadding_bottom))
+    {
+        tile_upscale_nearest(pixeldata, w, channels, scale, xi * TILE_SIZE_X, row_y0, tile_w_nopad, tile_h_nopad, (unsigned char*)outimage.data);
+        return 0;
+    }
+
+    // cached tile, no inference
+    TileCacheKey tile_key;
+    if (tile_cache)
+    {
+        tile_key = tile_cache_key(inimage, xi, row_y0, row_y1, prepadding_right, prepadding_bottom);
+
+        std::vector<unsigned char> tile_data;
+        if (tile_cache->get(tile_key, tile_data))
         {
-            prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
+            tile_copy_in(tile_data, channels, xi * TILE_SIZE_X * scale, row_y0 * scale, tile_w_nopad * scale, tile_h_nopad * scale, (unsigned char*)outimage.data, (size_t)w * scale * channels);
+            return 0;
         }
-        if (scale == 2)
+    }
+
+    // every blob of the arena pools below is released before the guard hands the arena back
+    Waifu2xCpuArenaGuard arena_guard(this);
+    Waifu2xCpuArena* arena = arena_guard.arena;
+
+    ncnn::Option tile_opt = opt;
+    tile_opt.blob_allocator = &arena->blob_allocator;
+    tile_opt.workspace_allocator = &arena->workspace_allocator;
+
+    // crop tile, normalize, border padding and split alpha
+    // create keeps the buffer of the previous tile when the shape is the same
+    ncnn::Mat* in_tile = arena->in_tile;
+    ncnn::Mat& in = in_tile[0];
+    ncnn::Mat& in_alpha_tile = arena->in_alpha_tile;
+    {
+        in.create(tile_w_nopad + prepadding + prepadding_right, tile_h_nopad + prepadding + prepadding_bottom, 3);
+
+        if (channels == 4)
         {
-            prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
+            in_alpha_tile.create(tile_w_nopad, tile_h_nopad, 1);
         }
 
-        int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
-        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
+        waifu2x_preproc_cpu(pixeldata, w, h, channels, xi * TILE_SIZE_X - prepadding, row_y0 - prepadding, in.w, in.h, in, in.cstep, channels == 4 ? (float*)in_alpha_tile : 0, prepadding, prepadding, tile_w_nopad, tile_h_nopad);
+    }
 
-        for (int xi = 0; xi < xtiles; xi++)
-        {
-            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+    ncnn::Mat out;
 
-            int prepadding_right = prepadding;
-            if (scale == 1)
-            {
-                prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
-            }
-            if (scale == 2)
+    if (tta_mode)
+    {
+        // the other 7 directions
+        {
+            const int tta_mask = tta_transform_mask(tta_mode);
+            for (int ti = 1; ti < 8; ti++)
             {
-                prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
-            }
+                if (!(tta_mask & (1 << ti)))
+                    continue;
 
-            int in_tile_x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
-            int in_tile_x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding_right, w);
+                if (ti < 4)
+                    in_tile[ti].create(in_tile[0].w, in_tile[0].h, 3);
+                else
+                    in_tile[ti].create(in_tile[0].h, in_tile[0].w, 3);
+            }
 
-            // crop tile
-            ncnn::Mat in, in_nopad;
+            for (int q = 0; q < 3; q++)
             {
-                if (channels == 3)
-                {
-#if _WIN32
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGR2RGB, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
-#else
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGB, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
-#endif
-                }
-                if (channels == 4)
+                float* outptrs[8];
+                for (int ti = 0; ti < 8; ti++)
                 {
-#if _WIN32
-                    in_nopad = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGRA2RGBA, w, h, xi * TILE_SIZE_X, yi * TILE_SIZE_Y, tile_w_nopad, tile_h_nopad);
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGRA2RGBA, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
-#else
-                    in_nopad = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGBA, w, h, xi * TILE_SIZE_X, yi * TILE_SIZE_Y, tile_w_nopad, tile_h_nopad);
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGBA, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
-#endif
+                    outptrs[ti] = in_tile[ti].empty() ? 0 : (float*)in_tile[ti].channel(q);
                 }
-            }
 
-            ncnn::Mat out;
+                waifu2x_tta_transform_cpu(in_tile[0].channel(q), in_tile[0].w, in_tile[0].h, outptrs);
+            }
+        }
 
-            if (tta_mode)
+        // waifu2x, the variants run concurrently and share the tile thread budget
+        // one pool per variant, so concurrent variants never contend on an allocator lock
+        ncnn::Mat out_tile[8];
+        {
+            int transforms[8];
+            int transform_count = 0;
+            for (int ti = 0; ti < 8; ti++)
             {
-                // split alpha and preproc
-                ncnn::Mat in_tile[8];
-                ncnn::Mat in_alpha_tile;
-                {
-                    in_tile[0].create(in.w, in.h, 3);
-                    for (int q = 0; q < 3; q++)
-                    {
-                        const float* ptr = in.channel(q);
-                        float* outptr0 = in_tile[0].channel(q);
-
-                        for (int i = 0; i < in.h; i++)
-                        {
-                            for (int j = 0; j < in.w; j++)
-                            {
-                                *outptr0++ = *ptr++ * (1 / 255.f);
-                            }
-                        }
-                    }
-
-                    if (channels == 4)
-                    {
-                        in_alpha_tile = in_nopad.channel_range(3, 1).clone();
-                    }
-                }
+                if (!in_tile[ti].empty())
+                    transforms[transform_count++] = ti;
+            }
 
-                // border padding
-                {
-                    int pad_top = std::max(prepadding - yi * TILE_SIZE_Y, 0);
-                    int pad_bottom = std::max(std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom - h, prepadding_bottom), 0);
-                    int pad_left = std::max(prepadding - xi * TILE_SIZE_X, 0);
-                    int pad_right = std::max(std::min((xi + 1) * TILE_SIZE_X + prepadding_right - w, prepadding_right), 0);
-
-                    ncnn::Mat in_tile_padded;
-                    ncnn::copy_make_border(in_tile[0], in_tile_padded, pad_top, pad_bottom, pad_left, pad_right, ncnn::BORDER_REPLICATE, 0.f, net.opt);
-                    in_tile[0] = in_tile_padded;
-                }
+            // adaptive tta runs the first pair alone and stops there when the two agree
+            const int transform_first = (tta_threshold > 0.f && transform_count > 2) ? 2 : transform_count;
 
-                // the other 7 directions
-                {
-                    in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
-
-                    for (int q = 0; q < 3; q++)
-                    {
-                        const ncnn::Mat in_tile_0 = in_tile[0].channel(q);
-                        ncnn::Mat in_tile_1 = in_tile[1].channel(q);
-                        ncnn::Mat in_tile_2 = in_tile[2].channel(q);
-                        ncnn::Mat in_tile_3 = in_tile[3].channel(q);
-                        ncnn::Mat in_tile_4 = in_tile[4].channel(q);
-                        ncnn::Mat in_tile_5 = in_tile[5].channel(q);
-                        ncnn::Mat in_tile_6 = in_tile[6].channel(q);
-                        ncnn::Mat in_tile_7 = in_tile[7].channel(q);
-
-                        for (int i = 0; i < in_tile[0].h; i++)
-                        {
-                            const float* outptr0 = in_tile_0.row(i);
-                            float* outptr1 = in_tile_1.row(in_tile[0].h - 1 - i);
-                            float* outptr2 = in_tile_2.row(i) + in_tile[0].w - 1;
-                            float* outptr3 = in_tile_3.row(in_tile[0].h - 1 - i) + in_tile[0].w - 1;
-
-                            for (int j = 0; j < in_tile[0].w; j++)
-                            {
-                                float* outptr4 = in_tile_4.row(j) + i;
-                                float* outptr5 = in_tile_5.row(in_tile[0].w - 1 - j) + i;
-                                float* outptr6 = in_tile_6.row(j) + in_tile[0].h - 1 - i;
-                                float* outptr7 = in_tile_7.row(in_tile[0].w - 1 - j) + in_tile[0].h - 1 - i;
-
-                                float v = *outptr0++;
-
-                                *outptr1++ = v;
-                                *outptr2-- = v;
-                                *outptr3-- = v;
-                                *outptr4 = v;
-                                *outptr5 = v;
-                                *outptr6 = v;
-                                *outptr7 = v;
-                            }
-                        }
-                    }
-                }
+            Waifu2xCpuTtaTask task;
+            task.net = &net;
+            task.transforms = transforms;
+            task.in_tile = in_tile;
+            task.out_tile = out_tile;
+            task.blob_allocators = arena->tta_blob_allocators;
+            task.workspace_allocators = arena->tta_workspace_allocators;
 
-                // waifu2x
-                ncnn::Mat out_tile[8];
-                for (int ti = 0; ti < 8; ti++)
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+            int variant_jobs = std::min(opt.num_threads, transform_first);
+            task.num_threads = std::max(opt.num_threads / variant_jobs, 1);
 
-                    ex.input("Input1", in_tile[ti]);
+            cpu_thread_pool->run(task, transform_first, variant_jobs);
 
-                    ex.extract("Eltwise4", out_tile[ti]);
-                }
+            if (transform_first < transform_count)
+            {
+                // mean difference of the pair in 8bit levels
+                const ncnn::Mat& out_tile_0 = out_tile[transforms[0]];
+                const ncnn::Mat& out_tile_1 = out_tile[transforms[1]];
 
-                ncnn::Mat out_alpha_tile;
-                if (channels == 4)
+                double diff_sum = 0.0;
+                for (int q = 0; q < 3; q++)
                 {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile = in_alpha_tile;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
+                    diff_sum += waifu2x_tta_diff_cpu(out_tile_0.channel(q), out_tile_1.channel(q), transforms[1], out_tile_0.w, out_tile_0.h, tile_w_nopad * scale, tile_h_nopad * scale);
                 }
 
-                // postproc and merge alpha
+                const double tta_diff = diff_sum / ((double)tile_w_nopad * scale * tile_h_nopad * scale * 3);
+
+                if (tta_diff >= tta_threshold)
                 {
-                    out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
-                    for (int q = 0; q < 3; q++)
-                    {
-                        const ncnn::Mat out_tile_0 = out_tile[0].channel(q);
-                        const ncnn::Mat out_tile_1 = out_tile[1].channel(q);
-                        const ncnn::Mat out_tile_2 = out_tile[2].channel(q);
-                        const ncnn::Mat out_tile_3 = out_tile[3].channel(q);
-                        const ncnn::Mat out_tile_4 = out_tile[4].channel(q);
-                        const ncnn::Mat out_tile_5 = out_tile[5].channel(q);
-                        const ncnn::Mat out_tile_6 = out_tile[6].channel(q);
-                        const ncnn::Mat out_tile_7 = out_tile[7].channel(q);
-                        float* outptr = out.channel(q);
-
-                        for (int i = 0; i < out.h; i++)
-                        {
-                            const float* ptr0 = out_tile_0.row(i);
-                            const float* ptr1 = out_tile_1.row(out_tile[0].h - 1 - i);
-                            const float* ptr2 = out_tile_2.row(i) + out_tile[0].w - 1;
-                            const float* ptr3 = out_tile_3.row(out_tile[0].h - 1 - i) + out_tile[0].w - 1;
-
-                            for (int j = 0; j < out.w; j++)
-                            {
-                                const float* ptr4 = out_tile_4.row(j) + i;
-                                const float* ptr5 = out_tile_5.row(out_tile[0].w - 1 - j) + i;
-                                const float* ptr6 = out_tile_6.row(j) + out_tile[0].h - 1 - i;
-                                const float* ptr7 = out_tile_7.row(out_tile[0].w - 1 - j) + out_tile[0].h - 1 - i;
-
-                                float v = (*ptr0++ + *ptr1++ + *ptr2-- + *ptr3-- + *ptr4 + *ptr5 + *ptr6 + *ptr7) / 8;
-
-                                *outptr++ = v * 255.f + 0.5f;
-                            }
-                        }
-                    }
+                    task.transforms = transforms + transform_first;
 
-                    if (channels == 4)
-                    {
-                        memcpy(out.channel_range(3, 1), out_alpha_tile, out_alpha_tile.total() * sizeof(float));
-                    }
+                    variant_jobs = std::min(opt.num_threads, transform_count - transform_first);
+                    task.num_threads = std::max(opt.num_threads / variant_jobs, 1);
+
+                    cpu_thread_pool->run(task, transform_count - transform_first, variant_jobs);
                 }
             }
-            else
-            {
-                // split alpha and preproc
-                ncnn::Mat in_tile;
-                ncnn::Mat in_alpha_tile;
-                {
-                    in_tile.create(in.w, in.h, 3);
-                    for (int q = 0; q < 3; q++)
-                    {
-                        const float* ptr = in.channel(q);
-                        float* outptr = in_tile.channel(q);
+        }
 
-                        for (int i = 0; i < in.w * in.h; i++)
-                        {
-                            *outptr++ = *ptr++ * (1 / 255.f);
-                        }
-                    }
+        // merge
+        {
+            ncnn::Mat& merged = arena->merged;
+            merged.create(tile_w_nopad * scale, tile_h_nopad * scale, 3);
 
-                    if (channels == 4)
-                    {
-                        in_alpha_tile = in_nopad.channel_range(3, 1).clone();
-                    }
-                }
+            ncnn::Mat& merge_workspace = arena->merge_workspace;
+            merge_workspace.create(merged.h, merged.w);
 
-                // border padding
+            for (int q = 0; q < 3; q++)
+            {
+                const float* ptrs[8];
+                for (int ti = 0; ti < 8; ti++)
                 {
-                    int pad_top = std::max(prepadding - yi * TILE_SIZE_Y, 0);
-                    int pad_bottom = std::max(std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom - h, prepadding_bottom), 0);
-                    int pad_left = std::max(prepadding - xi * TILE_SIZE_X, 0);
-                    int pad_right = std::max(std::min((xi + 1) * TILE_SIZE_X + prepadding_right - w, prepadding_right), 0);
-
-                    ncnn::Mat in_tile_padded;
-                    ncnn::copy_make_border(in_tile, in_tile_padded, pad_top, pad_bottom, pad_left, pad_right, ncnn::BORDER_REPLICATE, 0.f, net.opt);
-                    in_tile = in_tile_padded;
+                    ptrs[ti] = out_tile[ti].empty() ? 0 : (const float*)out_tile[ti].channel(q);
                 }
 
-                // waifu2x
-                ncnn::Mat out_tile;
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+                waifu2x_tta_merge_cpu(ptrs, out_tile[0].w, out_tile[0].h, merged.channel(q), merged.w, merged.h, merge_workspace);
+            }
 
-                    ex.input("Input1", in_tile);
+            out = merged;
+        }
+    }
+    else
+    {
+        // waifu2x
+        ncnn::Extractor ex = net.create_extractor();
 
-                    ex.extract("Eltwise4", out_tile);
-                }
+        ex.set_num_threads(opt.num_threads);
+        ex.set_blob_allocator(tile_opt.blob_allocator);
+        ex.set_workspace_allocator(tile_opt.workspace_allocator);
 
-                ncnn::Mat out_alpha_tile;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile = in_alpha_tile;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                }
+        ex.input("Input1", in);
 
-                // postproc and merge alpha
-                {
-                    out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
-                    for (int q = 0; q < 3; q++)
-                    {
-                        float* outptr = out.channel(q);
+        ex.extract("Eltwise4", out);
+    }
 
-                        for (int i = 0; i < out.h; i++)
-                        {
-                            const float* ptr = out_tile.channel(q).row(i);
+    ncnn::Mat out_alpha_tile;
+    if (channels == 4)
+    {
+        if (scale == 1)
+        {
+            out_alpha_tile = in_alpha_tile;
+        }
+        if (scale == 2)
+        {
+            bicubic_2x->forward(in_alpha_tile, out_alpha_tile, tile_opt);
+        }
+    }
 
-                            for (int j = 0; j < out.w; j++)
-                            {
-                                *outptr++ = *ptr++ * 255.f + 0.5f;
-                            }
-                        }
-                    }
+    // postproc, merge alpha and store
+    {
+        unsigned char* outptr = (unsigned char*)outimage.data + (size_t)row_y0 * scale * w * scale * channels + (size_t)xi * scale * TILE_SIZE_X * channels;
 
-                    if (channels == 4)
-                    {
-                        memcpy(out.channel_range(3, 1), out_alpha_tile, out_alpha_tile.total() * sizeof(float));
-                    }
-                }
-            }
+        waifu2x_postproc_cpu(out, out.w, out.cstep, out_alpha_tile, out_alpha_tile.w, tile_w_nopad * scale, tile_h_nopad * scale, channels, outptr, (size_t)w * scale * channels);
+    }
 
-            {
-                if (channels == 3)
-                {
-#if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGB2BGR, w * scale * channels);
-#else
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGB, w * scale * channels);
-#endif
-                }
-                if (channels == 4)
-                {
-#if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGBA2BGRA, w * scale * channels);
-#else
-                    out.to_pixels((unsigned char*)outimage.data + (size_t)yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGBA, w * scale * channels);
-#endif
-                }
-            }
-        }
+    if (tile_cache)
+    {
+        std::vector<unsigned char> tile_data;
+        tile_copy_out((const unsigned char*)outimage.data, (size_t)w * scale * channels, channels, xi * TILE_SIZE_X * scale, row_y0 * scale, tile_w_nopad * scale, tile_h_nopad * scale, tile_data);
+
+        tile_cache->put(tile_key, tile_data);
     }
 
     return 0;
 }
+
+Waifu2xCpuArena* Waifu2x::acquire_cpu_arena() const
+{
+    ncnn::MutexLockGuard guard(cpu_arenas_lock);
+
+    if (cpu_arenas.empty())
+        return new Waifu2xCpuArena;
+
+    // the most recently used one has its pages still warm
+    Waifu2xCpuArena* arena = cpu_arenas.back();
+    cpu_arenas.pop_back();
+
+    return arena;
+}
+
+void Waifu2x::reclaim_cpu_arena(Waifu2xCpuArena* arena) const
+{
+    ncnn::MutexLockGuard guard(cpu_arenas_lock);
+
+    cpu_arenas.push_back(arena);
+}
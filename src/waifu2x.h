@@ -4,16 +4,22 @@
 #define WAIFU2X_H
 
 #include <string>
+#include <vector>
 
 // ncnn
 #include "net.h"
 #include "gpu.h"
 #include "layer.h"
 
+#include "waifu2x_tile_cache.h"
+
+class Waifu2xCpuArena;
+class Waifu2xThreadPool;
+
 class Waifu2x
 {
 public:
-    Waifu2x(int gpuid, bool tta_mode = false, int num_threads = 1);
+    Waifu2x(int gpuid, int tta_mode = 0, int num_threads = 1);
     ~Waifu2x();
 
 #if _WIN32
@@ -24,7 +30,18 @@ public:
 
     int process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
 
-    int process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
+    // tile rows process() goes through, 0 when the output is the input
+    int tile_rows(const ncnn::Mat& inimage) const;
+
+    // only tile rows yi0 to yi1 of the whole outimage, for threads sharing one image
+    int process_rows(const ncnn::Mat& inimage, ncnn::Mat& outimage, int yi0, int yi1) const;
+
+    // only rows y0 to y1 of the whole outimage, tiled on their own with the input rows around them as model context
+    // for instances sharing one image, written in place
+    int process_band(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1) const;
+
+    // tile rows yi0 to yi1 of the rows y0 to y1 tiled on their own
+    int process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1, int yi0, int yi1) const;
 
 public:
     // waifu2x parameters
@@ -33,13 +50,57 @@ public:
     int tilesize;
     int prepadding;
 
+    // cpu only, tiles processed concurrently, 0 = auto
+    int tile_threads;
+
+    // adaptive tta, a tile whose first transform pair differs less than this mean 8bit level skips the other transforms, 0 = off
+    float tta_threshold;
+
+    // tiles whose padded input spans at most this many 8bit levels in every channel are upscaled without inference, -1 = off
+    int flat_threshold;
+
+    // output tiles shared with other instances and reused for identical input, 0 = off
+    TileCache* tile_cache;
+
+private:
+    friend class Waifu2xCpuTileTask;
+    friend class Waifu2xCpuArenaGuard;
+
+    // tile rows yi0 to yi1 of the rows y0 to y1 tiled on their own
+    int process_tile_rows(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1, int yi0, int yi1) const;
+
+    // whether the tile of column xi in rows row_y0 to row_y1 is upscaled with nearest neighbour instead of the model
+    bool tile_skips_model(const ncnn::Mat& inimage, int xi, int row_y0, int row_y1, int prepadding_right, int prepadding_bottom) const;
+
+    // side of the equal tiles that cover length pixels, at most tilesize
+    int tile_size(int length) const;
+
+    // hash of the padded input tile and every setting that changes its output
+    TileCacheKey tile_cache_key(const ncnn::Mat& inimage, int xi, int row_y0, int row_y1, int prepadding_right, int prepadding_bottom) const;
+
+    int process_cpu_tile(const ncnn::Mat& inimage, ncnn::Mat& outimage, int xi, int row_y0, int row_y1, const ncnn::Option& opt) const;
+
+    // allocators and tile buffers for one concurrent cpu tile, reused across tiles and images
+    Waifu2xCpuArena* acquire_cpu_arena() const;
+    void reclaim_cpu_arena(Waifu2xCpuArena* arena) const;
+
 private:
     ncnn::VulkanDevice* vkdev;
     ncnn::Net net;
     ncnn::Pipeline* waifu2x_preproc;
     ncnn::Pipeline* waifu2x_postproc;
+    ncnn::Pipeline* waifu2x_postproc_pair;
+    ncnn::Pipeline* waifu2x_tta_diff;
     ncnn::Layer* bicubic_2x;
-    bool tta_mode;
+    // tta transform count, 0 = off, 2 4 or 8
+    int tta_mode;
+    // identifies the loaded model in tile cache keys
+    TileCacheKey model_key;
+    // idle cpu arenas, as many exist as tiles ever ran at once
+    mutable std::vector<Waifu2xCpuArena*> cpu_arenas;
+    mutable ncnn::Mutex cpu_arenas_lock;
+    // threads for concurrent cpu tiles and tta variants, 0 on gpu
+    Waifu2xThreadPool* cpu_thread_pool;
 };
 
 #endif // WAIFU2X_H
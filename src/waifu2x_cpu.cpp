@@ -0,0 +1,121 @@
+// waifu2x implemented with ncnn library
+
+#include "waifu2x_cpu.h"
+
+#include "waifu2x_cpu_kernel.h"
+
+// ncnn
+#include "cpu.h"
+
+#if WAIFU2X_CPU_AVX512
+void waifu2x_preproc_cpu_avx512(const unsigned char* pixeldata, int w, int h, int channels, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah);
+void waifu2x_postproc_cpu_avx512(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, int channels, unsigned char* outptr, size_t outstride);
+void waifu2x_tta_transform_cpu_avx512(const float* ptr, int w, int h, float* const* outptrs);
+void waifu2x_tta_merge_cpu_avx512(const float* const* ptrs, int w, int h, float* outptr, int outw, int outh, float* tmpptr);
+double waifu2x_tta_diff_cpu_avx512(const float* ptr0, const float* ptrk, int k, int w, int h, int outw, int outh);
+#endif
+#if WAIFU2X_CPU_AVX2
+void waifu2x_preproc_cpu_avx2(const unsigned char* pixeldata, int w, int h, int channels, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah);
+void waifu2x_postproc_cpu_avx2(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, int channels, unsigned char* outptr, size_t outstride);
+void waifu2x_tta_transform_cpu_avx2(const float* ptr, int w, int h, float* const* outptrs);
+void waifu2x_tta_merge_cpu_avx2(const float* const* ptrs, int w, int h, float* outptr, int outw, int outh, float* tmpptr);
+double waifu2x_tta_diff_cpu_avx2(const float* ptr0, const float* ptrk, int k, int w, int h, int outw, int outh);
+#endif
+
+void waifu2x_preproc_cpu(const unsigned char* pixeldata, int w, int h, int channels, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah)
+{
+#if WAIFU2X_CPU_AVX512
+    if (ncnn::cpu_support_x86_avx512())
+    {
+        waifu2x_preproc_cpu_avx512(pixeldata, w, h, channels, x0, y0, outw, outh, outptr, outcstep, alphaptr, alphax, alphay, alphaw, alphah);
+        return;
+    }
+#endif
+#if WAIFU2X_CPU_AVX2
+    if (ncnn::cpu_support_x86_avx2())
+    {
+        waifu2x_preproc_cpu_avx2(pixeldata, w, h, channels, x0, y0, outw, outh, outptr, outcstep, alphaptr, alphax, alphay, alphaw, alphah);
+        return;
+    }
+#endif
+
+    preproc(pixeldata, w, h, channels, x0, y0, outw, outh, outptr, outcstep, alphaptr, alphax, alphay, alphaw, alphah);
+}
+
+void waifu2x_postproc_cpu(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, int channels, unsigned char* outptr, size_t outstride)
+{
+#if WAIFU2X_CPU_AVX512
+    if (ncnn::cpu_support_x86_avx512())
+    {
+        waifu2x_postproc_cpu_avx512(ptr, w, cstep, alphaptr, alphaw, outw, outh, channels, outptr, outstride);
+        return;
+    }
+#endif
+#if WAIFU2X_CPU_AVX2
+    if (ncnn::cpu_support_x86_avx2())
+    {
+        waifu2x_postproc_cpu_avx2(ptr, w, cstep, alphaptr, alphaw, outw, outh, channels, outptr, outstride);
+        return;
+    }
+#endif
+
+    postproc(ptr, w, cstep, alphaptr, alphaw, outw, outh, channels, outptr, outstride);
+}
+
+void waifu2x_tta_transform_cpu(const float* ptr, int w, int h, float* const* outptrs)
+{
+#if WAIFU2X_CPU_AVX512
+    if (ncnn::cpu_support_x86_avx512())
+    {
+        waifu2x_tta_transform_cpu_avx512(ptr, w, h, outptrs);
+        return;
+    }
+#endif
+#if WAIFU2X_CPU_AVX2
+    if (ncnn::cpu_support_x86_avx2())
+    {
+        waifu2x_tta_transform_cpu_avx2(ptr, w, h, outptrs);
+        return;
+    }
+#endif
+
+    tta_transform(ptr, w, h, outptrs);
+}
+
+void waifu2x_tta_merge_cpu(const float* const* ptrs, int w, int h, float* outptr, int outw, int outh, float* tmpptr)
+{
+#if WAIFU2X_CPU_AVX512
+    if (ncnn::cpu_support_x86_avx512())
+    {
+        waifu2x_tta_merge_cpu_avx512(ptrs, w, h, outptr, outw, outh, tmpptr);
+        return;
+    }
+#endif
+#if WAIFU2X_CPU_AVX2
+    if (ncnn::cpu_support_x86_avx2())
+    {
+        waifu2x_tta_merge_cpu_avx2(ptrs, w, h, outptr, outw, outh, tmpptr);
+        return;
+    }
+#endif
+
+    tta_merge(ptrs, w, h, outptr, outw, outh, tmpptr);
+}
+
+double waifu2x_tta_diff_cpu(const float* ptr0, const float* ptrk, int k, int w, int h, int outw, int outh)
+{
+#if WAIFU2X_CPU_AVX512
+    if (ncnn::cpu_support_x86_avx512())
+    {
+        return waifu2x_tta_diff_cpu_avx512(ptr0, ptrk, k, w, h, outw, outh);
+    }
+#endif
+#if WAIFU2X_CPU_AVX2
+    if (ncnn::cpu_support_x86_avx2())
+    {
+        return waifu2x_tta_diff_cpu_avx2(ptr0, ptrk, k, w, h, outw, outh);
+    }
+#endif
+
+    return tta_diff(ptr0, ptrk, k, w, h, outw, outh);
+}
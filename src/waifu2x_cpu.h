@@ -0,0 +1,33 @@
+// waifu2x implemented with ncnn library
+
+#ifndef WAIFU2X_CPU_H
+#define WAIFU2X_CPU_H
+
+#include <stddef.h>
+
+// crop the outw x outh tile at x0,y0 from interleaved rgb(a) pixeldata, x0,y0 may be negative
+// out of image pixels replicate the nearest border pixel
+// rgb is normalized to [0, 1] and written as 3 planes of outw x outh, outcstep apart
+// when alphaptr is given, the raw alpha of the alphaw x alphah region at alphax,alphay inside the tile is written there
+void waifu2x_preproc_cpu(const unsigned char* pixeldata, int w, int h, int channels, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah);
+
+// denormalize the outw x outh region of the rgb planes with row stride w and cstep apart, clamp to 8bit
+// and write interleaved rgb(a) rows outstride bytes apart, the alpha plane with row stride alphaw is stored as is
+void waifu2x_postproc_cpu(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, int channels, unsigned char* outptr, size_t outstride);
+
+// write the tta transforms of the w x h plane ptr to outptrs[1..7], null outptrs are skipped
+// transform k moves [y][x] to
+//   0 [y][x]  1 [y][w-1-x]  2 [h-1-y][w-1-x]  3 [h-1-y][x]
+//   4 [x][y]  5 [x][h-1-y]  6 [w-1-x][h-1-y]  7 [w-1-x][y]
+// the same order as waifu2x_preproc_tta.comp, transforms 4 to 7 are h x w
+void waifu2x_tta_transform_cpu(const float* ptr, int w, int h, float* const* outptrs);
+
+// undo the tta transforms of the w x h planes ptrs and average them into the top left outw x outh of outptr
+// null ptrs are left out of the average, tmpptr is outw x outh workspace
+void waifu2x_tta_merge_cpu(const float* const* ptrs, int w, int h, float* outptr, int outw, int outh, float* tmpptr);
+
+// how much tta transform k in 1 to 3 disagrees with transform 0 over the top left outw x outh of the w x h planes
+// returns the sum of min(|difference| * 255, 8), the difference in 8bit levels clamped at 8
+double waifu2x_tta_diff_cpu(const float* ptr0, const float* ptrk, int k, int w, int h, int outw, int outh);
+
+#endif // WAIFU2X_CPU_H
@@ -0,0 +1,28 @@
+// waifu2x implemented with ncnn library
+
+#include "waifu2x_cpu_kernel.h"
+
+void waifu2x_preproc_cpu_avx512(const unsigned char* pixeldata, int w, int h, int channels, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah)
+{
+    preproc(pixeldata, w, h, channels, x0, y0, outw, outh, outptr, outcstep, alphaptr, alphax, alphay, alphaw, alphah);
+}
+
+void waifu2x_postproc_cpu_avx512(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, int channels, unsigned char* outptr, size_t outstride)
+{
+    postproc(ptr, w, cstep, alphaptr, alphaw, outw, outh, channels, outptr, outstride);
+}
+
+void waifu2x_tta_transform_cpu_avx512(const float* ptr, int w, int h, float* const* outptrs)
+{
+    tta_transform(ptr, w, h, outptrs);
+}
+
+void waifu2x_tta_merge_cpu_avx512(const float* const* ptrs, int w, int h, float* outptr, int outw, int outh, float* tmpptr)
+{
+    tta_merge(ptrs, w, h, outptr, outw, outh, tmpptr);
+}
+
+double waifu2x_tta_diff_cpu_avx512(const float* ptr0, const float* ptrk, int k, int w, int h, int outw, int outh)
+{
+    return tta_diff(ptr0, ptrk, k, w, h, outw, outh);
+}
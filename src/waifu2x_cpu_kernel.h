@@ -0,0 +1,801 @@
+// waifu2x implemented with ncnn library
+
+// cpu kernels shared by waifu2x_cpu.cpp and the isa specific waifu2x_cpu_*.cpp
+// every translation unit compiles its own copy with its own target flags,
+// keep everything in the anonymous namespace and do not include any c++ library template here
+
+#ifndef WAIFU2X_CPU_KERNEL_H
+#define WAIFU2X_CPU_KERNEL_H
+
+#include <stddef.h>
+#include <string.h>
+
+#if __AVX2__
+#include <immintrin.h>
+#endif
+#if __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+static inline int min_int(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static inline int max_int(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+#if __AVX2__
+static inline void deinterleave_rgb_u8x16(const unsigned char* p, __m128i& _r, __m128i& _g, __m128i& _b)
+{
+    __m128i _p0 = _mm_loadu_si128((const __m128i*)p);
+    __m128i _p1 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i _p2 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+    _r = _mm_or_si128(_mm_or_si128(
+             _mm_shuffle_epi8(_p0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+             _mm_shuffle_epi8(_p1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+             _mm_shuffle_epi8(_p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    _g = _mm_or_si128(_mm_or_si128(
+             _mm_shuffle_epi8(_p0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+             _mm_shuffle_epi8(_p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+             _mm_shuffle_epi8(_p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    _b = _mm_or_si128(_mm_or_si128(
+             _mm_shuffle_epi8(_p0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+             _mm_shuffle_epi8(_p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+             _mm_shuffle_epi8(_p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+static inline void deinterleave_rgba_u8x16(const unsigned char* p, __m128i& _r, __m128i& _g, __m128i& _b, __m128i& _a)
+{
+    const __m128i _m = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+
+    // r0123 g0123 b0123 a0123
+    __m128i _p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), _m);
+    __m128i _p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), _m);
+    __m128i _p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), _m);
+    __m128i _p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), _m);
+
+    __m128i _t0 = _mm_unpacklo_epi32(_p0, _p1);
+    __m128i _t1 = _mm_unpackhi_epi32(_p0, _p1);
+    __m128i _t2 = _mm_unpacklo_epi32(_p2, _p3);
+    __m128i _t3 = _mm_unpackhi_epi32(_p2, _p3);
+
+    _r = _mm_unpacklo_epi64(_t0, _t2);
+    _g = _mm_unpackhi_epi64(_t0, _t2);
+    _b = _mm_unpacklo_epi64(_t1, _t3);
+    _a = _mm_unpackhi_epi64(_t1, _t3);
+}
+
+static inline void store_u8x16_as_float(__m128i _v, float* ptr, float scale)
+{
+#if __AVX512F__
+    _mm512_storeu_ps(ptr, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_v)), _mm512_set1_ps(scale)));
+#else
+    __m256 _scale = _mm256_set1_ps(scale);
+    _mm256_storeu_ps(ptr, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_v)), _scale));
+    _mm256_storeu_ps(ptr + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(_v, 8))), _scale));
+#endif
+}
+
+static inline void interleave_rgb_u8x16(__m128i _r, __m128i _g, __m128i _b, unsigned char* p)
+{
+    __m128i _p0 = _mm_or_si128(_mm_or_si128(
+                      _mm_shuffle_epi8(_r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+                      _mm_shuffle_epi8(_g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+                      _mm_shuffle_epi8(_b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+    __m128i _p1 = _mm_or_si128(_mm_or_si128(
+                      _mm_shuffle_epi8(_r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+                      _mm_shuffle_epi8(_g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+                      _mm_shuffle_epi8(_b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+    __m128i _p2 = _mm_or_si128(_mm_or_si128(
+                      _mm_shuffle_epi8(_r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+                      _mm_shuffle_epi8(_g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+                      _mm_shuffle_epi8(_b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+    _mm_storeu_si128((__m128i*)p, _p0);
+    _mm_storeu_si128((__m128i*)(p + 16), _p1);
+    _mm_storeu_si128((__m128i*)(p + 32), _p2);
+}
+
+static inline void interleave_rgba_u8x16(__m128i _r, __m128i _g, __m128i _b, __m128i _a, unsigned char* p)
+{
+    __m128i _rg0 = _mm_unpacklo_epi8(_r, _g);
+    __m128i _rg1 = _mm_unpackhi_epi8(_r, _g);
+    __m128i _ba0 = _mm_unpacklo_epi8(_b, _a);
+    __m128i _ba1 = _mm_unpackhi_epi8(_b, _a);
+
+    _mm_storeu_si128((__m128i*)p, _mm_unpacklo_epi16(_rg0, _ba0));
+    _mm_storeu_si128((__m128i*)(p + 16), _mm_unpackhi_epi16(_rg0, _ba0));
+    _mm_storeu_si128((__m128i*)(p + 32), _mm_unpacklo_epi16(_rg1, _ba1));
+    _mm_storeu_si128((__m128i*)(p + 48), _mm_unpackhi_epi16(_rg1, _ba1));
+}
+
+// v * scale + bias, truncate and saturate to 8bit
+static inline __m128i load_float_as_u8x16(const float* ptr, float scale, float bias)
+{
+#if __AVX512F__
+    __m512 _v = _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(ptr), _mm512_set1_ps(scale)), _mm512_set1_ps(bias));
+    return _mm512_cvtusepi32_epi8(_mm512_max_epi32(_mm512_cvttps_epi32(_v), _mm512_setzero_si512()));
+#else
+    __m256 _scale = _mm256_set1_ps(scale);
+    __m256 _bias = _mm256_set1_ps(bias);
+    __m256i _v0 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(ptr), _scale), _bias));
+    __m256i _v1 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(ptr + 8), _scale), _bias));
+    __m128i _s0 = _mm_packs_epi32(_mm256_castsi256_si128(_v0), _mm256_extracti128_si256(_v0, 1));
+    __m128i _s1 = _mm_packs_epi32(_mm256_castsi256_si128(_v1), _mm256_extracti128_si256(_v1, 1));
+    return _mm_packus_epi16(_s0, _s1);
+#endif
+}
+
+// p[0] p[-1] ... p[-7]
+static inline __m256 loadu_reversed_ps(const float* p)
+{
+    return _mm256_permutevar8x32_ps(_mm256_loadu_ps(p - 7), _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+static inline void transpose8_ps(__m256& _r0, __m256& _r1, __m256& _r2, __m256& _r3, __m256& _r4, __m256& _r5, __m256& _r6, __m256& _r7)
+{
+    __m256 _t0 = _mm256_unpacklo_ps(_r0, _r1);
+    __m256 _t1 = _mm256_unpackhi_ps(_r0, _r1);
+    __m256 _t2 = _mm256_unpacklo_ps(_r2, _r3);
+    __m256 _t3 = _mm256_unpackhi_ps(_r2, _r3);
+    __m256 _t4 = _mm256_unpacklo_ps(_r4, _r5);
+    __m256 _t5 = _mm256_unpackhi_ps(_r4, _r5);
+    __m256 _t6 = _mm256_unpacklo_ps(_r6, _r7);
+    __m256 _t7 = _mm256_unpackhi_ps(_r6, _r7);
+
+    __m256 _tt0 = _mm256_shuffle_ps(_t0, _t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 _tt1 = _mm256_shuffle_ps(_t0, _t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 _tt2 = _mm256_shuffle_ps(_t1, _t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 _tt3 = _mm256_shuffle_ps(_t1, _t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 _tt4 = _mm256_shuffle_ps(_t4, _t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 _tt5 = _mm256_shuffle_ps(_t4, _t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 _tt6 = _mm256_shuffle_ps(_t5, _t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 _tt7 = _mm256_shuffle_ps(_t5, _t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    _r0 = _mm256_permute2f128_ps(_tt0, _tt4, 0x20);
+    _r1 = _mm256_permute2f128_ps(_tt1, _tt5, 0x20);
+    _r2 = _mm256_permute2f128_ps(_tt2, _tt6, 0x20);
+    _r3 = _mm256_permute2f128_ps(_tt3, _tt7, 0x20);
+    _r4 = _mm256_permute2f128_ps(_tt0, _tt4, 0x31);
+    _r5 = _mm256_permute2f128_ps(_tt1, _tt5, 0x31);
+    _r6 = _mm256_permute2f128_ps(_tt2, _tt6, 0x31);
+    _r7 = _mm256_permute2f128_ps(_tt3, _tt7, 0x31);
+}
+#endif // __AVX2__
+
+#if __ARM_NEON
+static inline uint8x16_t load_float_as_u8x16(const float* ptr, float scale, float bias)
+{
+    float32x4_t _bias = vdupq_n_f32(bias);
+    int32x4_t _v0 = vcvtq_s32_f32(vmlaq_n_f32(_bias, vld1q_f32(ptr), scale));
+    int32x4_t _v1 = vcvtq_s32_f32(vmlaq_n_f32(_bias, vld1q_f32(ptr + 4), scale));
+    int32x4_t _v2 = vcvtq_s32_f32(vmlaq_n_f32(_bias, vld1q_f32(ptr + 8), scale));
+    int32x4_t _v3 = vcvtq_s32_f32(vmlaq_n_f32(_bias, vld1q_f32(ptr + 12), scale));
+    uint16x8_t _s01 = vcombine_u16(vqmovun_s32(_v0), vqmovun_s32(_v1));
+    uint16x8_t _s23 = vcombine_u16(vqmovun_s32(_v2), vqmovun_s32(_v3));
+    return vcombine_u8(vqmovn_u16(_s01), vqmovn_u16(_s23));
+}
+
+static inline void store_u8x16_as_float(uint8x16_t _v, float* ptr, float scale)
+{
+    uint16x8_t _v01 = vmovl_u8(vget_low_u8(_v));
+    uint16x8_t _v23 = vmovl_u8(vget_high_u8(_v));
+
+    vst1q_f32(ptr, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(_v01))), scale));
+    vst1q_f32(ptr + 4, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(_v01))), scale));
+    vst1q_f32(ptr + 8, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(_v23))), scale));
+    vst1q_f32(ptr + 12, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(_v23))), scale));
+}
+
+// p[0] p[-1] p[-2] p[-3]
+static inline float32x4_t vld1q_reversed_f32(const float* p)
+{
+    float32x4_t _v = vrev64q_f32(vld1q_f32(p - 3));
+    return vcombine_f32(vget_high_f32(_v), vget_low_f32(_v));
+}
+
+static inline void transpose4_ps(float32x4_t& _r0, float32x4_t& _r1, float32x4_t& _r2, float32x4_t& _r3)
+{
+    float32x4x2_t _t01 = vtrnq_f32(_r0, _r1);
+    float32x4x2_t _t23 = vtrnq_f32(_r2, _r3);
+
+    _r0 = vcombine_f32(vget_low_f32(_t01.val[0]), vget_low_f32(_t23.val[0]));
+    _r1 = vcombine_f32(vget_low_f32(_t01.val[1]), vget_low_f32(_t23.val[1]));
+    _r2 = vcombine_f32(vget_high_f32(_t01.val[0]), vget_high_f32(_t23.val[0]));
+    _r3 = vcombine_f32(vget_high_f32(_t01.val[1]), vget_high_f32(_t23.val[1]));
+}
+#endif // __ARM_NEON
+
+// n contiguous image pixels to normalized planar rgb
+template<int channels>
+static void preproc_row(const unsigned char* p, float* r, float* g, float* b, int n)
+{
+    const float norm_val = 1 / 255.f;
+
+    int j = 0;
+#if __AVX2__
+    for (; j + 15 < n; j += 16)
+    {
+        __m128i _r;
+        __m128i _g;
+        __m128i _b;
+        if (channels == 3)
+        {
+            deinterleave_rgb_u8x16(p, _r, _g, _b);
+        }
+        else
+        {
+            __m128i _a;
+            deinterleave_rgba_u8x16(p, _r, _g, _b, _a);
+        }
+
+        store_u8x16_as_float(_r, r + j, norm_val);
+        store_u8x16_as_float(_g, g + j, norm_val);
+        store_u8x16_as_float(_b, b + j, norm_val);
+
+        p += 16 * channels;
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    for (; j + 15 < n; j += 16)
+    {
+        if (channels == 3)
+        {
+            uint8x16x3_t _rgb = vld3q_u8(p);
+            store_u8x16_as_float(_rgb.val[0], r + j, norm_val);
+            store_u8x16_as_float(_rgb.val[1], g + j, norm_val);
+            store_u8x16_as_float(_rgb.val[2], b + j, norm_val);
+        }
+        else
+        {
+            uint8x16x4_t _rgba = vld4q_u8(p);
+            store_u8x16_as_float(_rgba.val[0], r + j, norm_val);
+            store_u8x16_as_float(_rgba.val[1], g + j, norm_val);
+            store_u8x16_as_float(_rgba.val[2], b + j, norm_val);
+        }
+
+        p += 16 * channels;
+    }
+#endif // __ARM_NEON
+    for (; j < n; j++)
+    {
+        r[j] = p[0] * norm_val;
+        g[j] = p[1] * norm_val;
+        b[j] = p[2] * norm_val;
+
+        p += channels;
+    }
+}
+
+template<int channels>
+static void preproc_tile(const unsigned char* pixeldata, int w, int h, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah)
+{
+    const float norm_val = 1 / 255.f;
+
+#if _WIN32
+    float* outptr0 = outptr + outcstep * 2;
+    float* outptr2 = outptr;
+#else
+    float* outptr0 = outptr;
+    float* outptr2 = outptr + outcstep * 2;
+#endif
+    float* outptr1 = outptr + outcstep;
+
+    // tile columns [pad_left, pad_right) are inside the image, the rest replicates the border
+    const int pad_left = min_int(max_int(-x0, 0), outw);
+    const int pad_right = max_int(min_int(w - x0, outw), pad_left);
+
+    for (int i = 0; i < outh; i++)
+    {
+        const int y = min_int(max_int(y0 + i, 0), h - 1);
+
+        const unsigned char* p = pixeldata + (size_t)y * w * channels;
+        float* r = outptr0 + (size_t)i * outw;
+        float* g = outptr1 + (size_t)i * outw;
+        float* b = outptr2 + (size_t)i * outw;
+
+        {
+            const float v0 = p[0] * norm_val;
+            const float v1 = p[1] * norm_val;
+            const float v2 = p[2] * norm_val;
+            for (int j = 0; j < pad_left; j++)
+            {
+                r[j] = v0;
+                g[j] = v1;
+                b[j] = v2;
+            }
+        }
+
+        preproc_row<channels>(p + (size_t)(x0 + pad_left) * channels, r + pad_left, g + pad_left, b + pad_left, pad_right - pad_left);
+
+        {
+            const unsigned char* pr = p + (size_t)(w - 1) * channels;
+            const float v0 = pr[0] * norm_val;
+            const float v1 = pr[1] * norm_val;
+            const float v2 = pr[2] * norm_val;
+            for (int j = pad_right; j < outw; j++)
+            {
+                r[j] = v0;
+                g[j] = v1;
+                b[j] = v2;
+            }
+        }
+
+        if (channels == 4 && alphaptr && i >= alphay && i < alphay + alphah)
+        {
+            // the alpha region never exceeds the image, read it from the row still in cache
+            const unsigned char* pa = p + (size_t)(x0 + alphax) * 4 + 3;
+            float* a = alphaptr + (size_t)(i - alphay) * alphaw;
+            for (int j = 0; j < alphaw; j++)
+            {
+                a[j] = pa[j * 4];
+            }
+        }
+    }
+}
+
+static void preproc(const unsigned char* pixeldata, int w, int h, int channels, int x0, int y0, int outw, int outh, float* outptr, size_t outcstep, float* alphaptr, int alphax, int alphay, int alphaw, int alphah)
+{
+    if (channels == 3)
+        preproc_tile<3>(pixeldata, w, h, x0, y0, outw, outh, outptr, outcstep, alphaptr, alphax, alphay, alphaw, alphah);
+    if (channels == 4)
+        preproc_tile<4>(pixeldata, w, h, x0, y0, outw, outh, outptr, outcstep, alphaptr, alphax, alphay, alphaw, alphah);
+}
+
+static inline unsigned char float_to_u8(float v)
+{
+    return (unsigned char)min_int(max_int((int)v, 0), 255);
+}
+
+// n planar pixels to interleaved 8bit rgb(a)
+template<int channels>
+static void postproc_row(const float* r, const float* g, const float* b, const float* a, unsigned char* p, int n)
+{
+    const float denorm_val = 255.f;
+    const float clip_eps = 0.5f;
+
+    int j = 0;
+#if __AVX2__
+    for (; j + 15 < n; j += 16)
+    {
+        __m128i _r = load_float_as_u8x16(r + j, denorm_val, clip_eps);
+        __m128i _g = load_float_as_u8x16(g + j, denorm_val, clip_eps);
+        __m128i _b = load_float_as_u8x16(b + j, denorm_val, clip_eps);
+        if (channels == 3)
+        {
+            interleave_rgb_u8x16(_r, _g, _b, p);
+        }
+        else
+        {
+            __m128i _a = load_float_as_u8x16(a + j, 1.f, 0.f);
+            interleave_rgba_u8x16(_r, _g, _b, _a, p);
+        }
+
+        p += 16 * channels;
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    for (; j + 15 < n; j += 16)
+    {
+        if (channels == 3)
+        {
+            uint8x16x3_t _rgb;
+            _rgb.val[0] = load_float_as_u8x16(r + j, denorm_val, clip_eps);
+            _rgb.val[1] = load_float_as_u8x16(g + j, denorm_val, clip_eps);
+            _rgb.val[2] = load_float_as_u8x16(b + j, denorm_val, clip_eps);
+            vst3q_u8(p, _rgb);
+        }
+        else
+        {
+            uint8x16x4_t _rgba;
+            _rgba.val[0] = load_float_as_u8x16(r + j, denorm_val, clip_eps);
+            _rgba.val[1] = load_float_as_u8x16(g + j, denorm_val, clip_eps);
+            _rgba.val[2] = load_float_as_u8x16(b + j, denorm_val, clip_eps);
+            _rgba.val[3] = load_float_as_u8x16(a + j, 1.f, 0.f);
+            vst4q_u8(p, _rgba);
+        }
+
+        p += 16 * channels;
+    }
+#endif // __ARM_NEON
+    for (; j < n; j++)
+    {
+        p[0] = float_to_u8(r[j] * denorm_val + clip_eps);
+        p[1] = float_to_u8(g[j] * denorm_val + clip_eps);
+        p[2] = float_to_u8(b[j] * denorm_val + clip_eps);
+        if (channels == 4)
+        {
+            p[3] = float_to_u8(a[j]);
+        }
+
+        p += channels;
+    }
+}
+
+template<int channels>
+static void postproc_tile(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, unsigned char* outptr, size_t outstride)
+{
+#if _WIN32
+    const float* ptr0 = ptr + cstep * 2;
+    const float* ptr2 = ptr;
+#else
+    const float* ptr0 = ptr;
+    const float* ptr2 = ptr + cstep * 2;
+#endif
+    const float* ptr1 = ptr + cstep;
+
+    for (int i = 0; i < outh; i++)
+    {
+        const float* a = channels == 4 ? alphaptr + (size_t)i * alphaw : 0;
+
+        postproc_row<channels>(ptr0 + (size_t)i * w, ptr1 + (size_t)i * w, ptr2 + (size_t)i * w, a, outptr + i * outstride, outw);
+    }
+}
+
+static void postproc(const float* ptr, int w, size_t cstep, const float* alphaptr, int alphaw, int outw, int outh, int channels, unsigned char* outptr, size_t outstride)
+{
+    if (channels == 3)
+        postproc_tile<3>(ptr, w, cstep, alphaptr, alphaw, outw, outh, outptr, outstride);
+    if (channels == 4)
+        postproc_tile<4>(ptr, w, cstep, alphaptr, alphaw, outw, outh, outptr, outstride);
+}
+
+// dst[n - 1 - j] = src[j]
+static void reverse_copy(const float* src, float* dst, int n)
+{
+    const float* p = src + n - 1;
+
+    int j = 0;
+#if __AVX2__
+    for (; j + 7 < n; j += 8)
+    {
+        _mm256_storeu_ps(dst + j, loadu_reversed_ps(p - j));
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    for (; j + 3 < n; j += 4)
+    {
+        vst1q_f32(dst + j, vld1q_reversed_f32(p - j));
+    }
+#endif // __ARM_NEON
+    for (; j < n; j++)
+    {
+        dst[j] = p[-j];
+    }
+}
+
+static void reverse_inplace(float* ptr, int n)
+{
+    for (int j = 0; j < n / 2; j++)
+    {
+        float t = ptr[j];
+        ptr[j] = ptr[n - 1 - j];
+        ptr[n - 1 - j] = t;
+    }
+}
+
+static void swap_rows(float* ptr0, float* ptr1, int n)
+{
+    for (int j = 0; j < n; j++)
+    {
+        float t = ptr0[j];
+        ptr0[j] = ptr1[j];
+        ptr1[j] = t;
+    }
+}
+
+// dst[x][y] = src[y][x] for the w x h src, or dst[x][y] = (dst[x][y] + src[y][x]) * scale when accumulating
+// walks 8x8 blocks so that neither side is written or read with a whole plane stride per element
+template<bool accumulate>
+static void transpose_plane(const float* src, int srcstride, float* dst, int dststride, int w, int h, float scale)
+{
+    const int block = 8;
+
+    for (int y0 = 0; y0 < h; y0 += block)
+    {
+        const int y1 = min_int(y0 + block, h);
+
+        for (int x0 = 0; x0 < w; x0 += block)
+        {
+            const int x1 = min_int(x0 + block, w);
+
+#if __AVX2__
+            if (y1 - y0 == 8 && x1 - x0 == 8)
+            {
+                const float* p = src + (size_t)y0 * srcstride + x0;
+                float* outp = dst + (size_t)x0 * dststride + y0;
+
+                __m256 _r0 = _mm256_loadu_ps(p);
+                __m256 _r1 = _mm256_loadu_ps(p + srcstride);
+                __m256 _r2 = _mm256_loadu_ps(p + srcstride * 2);
+                __m256 _r3 = _mm256_loadu_ps(p + srcstride * 3);
+                __m256 _r4 = _mm256_loadu_ps(p + srcstride * 4);
+                __m256 _r5 = _mm256_loadu_ps(p + srcstride * 5);
+                __m256 _r6 = _mm256_loadu_ps(p + srcstride * 6);
+                __m256 _r7 = _mm256_loadu_ps(p + srcstride * 7);
+
+                transpose8_ps(_r0, _r1, _r2, _r3, _r4, _r5, _r6, _r7);
+
+                if (accumulate)
+                {
+                    __m256 _scale = _mm256_set1_ps(scale);
+                    _r0 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp), _r0), _scale);
+                    _r1 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride), _r1), _scale);
+                    _r2 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride * 2), _r2), _scale);
+                    _r3 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride * 3), _r3), _scale);
+                    _r4 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride * 4), _r4), _scale);
+                    _r5 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride * 5), _r5), _scale);
+                    _r6 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride * 6), _r6), _scale);
+                    _r7 = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(outp + dststride * 7), _r7), _scale);
+                }
+
+                _mm256_storeu_ps(outp, _r0);
+                _mm256_storeu_ps(outp + dststride, _r1);
+                _mm256_storeu_ps(outp + dststride * 2, _r2);
+                _mm256_storeu_ps(outp + dststride * 3, _r3);
+                _mm256_storeu_ps(outp + dststride * 4, _r4);
+                _mm256_storeu_ps(outp + dststride * 5, _r5);
+                _mm256_storeu_ps(outp + dststride * 6, _r6);
+                _mm256_storeu_ps(outp + dststride * 7, _r7);
+                continue;
+            }
+#endif // __AVX2__
+#if __ARM_NEON
+            if (y1 - y0 == 8 && x1 - x0 == 8)
+            {
+                for (int yy = 0; yy < 8; yy += 4)
+                {
+                    for (int xx = 0; xx < 8; xx += 4)
+                    {
+                        const float* p = src + (size_t)(y0 + yy) * srcstride + x0 + xx;
+                        float* outp = dst + (size_t)(x0 + xx) * dststride + y0 + yy;
+
+                        float32x4_t _r0 = vld1q_f32(p);
+                        float32x4_t _r1 = vld1q_f32(p + srcstride);
+                        float32x4_t _r2 = vld1q_f32(p + srcstride * 2);
+                        float32x4_t _r3 = vld1q_f32(p + srcstride * 3);
+
+                        transpose4_ps(_r0, _r1, _r2, _r3);
+
+                        if (accumulate)
+                        {
+                            _r0 = vmulq_n_f32(vaddq_f32(vld1q_f32(outp), _r0), scale);
+                            _r1 = vmulq_n_f32(vaddq_f32(vld1q_f32(outp + dststride), _r1), scale);
+                            _r2 = vmulq_n_f32(vaddq_f32(vld1q_f32(outp + dststride * 2), _r2), scale);
+                            _r3 = vmulq_n_f32(vaddq_f32(vld1q_f32(outp + dststride * 3), _r3), scale);
+                        }
+
+                        vst1q_f32(outp, _r0);
+                        vst1q_f32(outp + dststride, _r1);
+                        vst1q_f32(outp + dststride * 2, _r2);
+                        vst1q_f32(outp + dststride * 3, _r3);
+                    }
+                }
+                continue;
+            }
+#endif // __ARM_NEON
+
+            for (int x = x0; x < x1; x++)
+            {
+                float* outp = dst + (size_t)x * dststride;
+
+                for (int y = y0; y < y1; y++)
+                {
+                    const float v = src[(size_t)y * srcstride + x];
+
+                    if (accumulate)
+                        outp[y] = (outp[y] + v) * scale;
+                    else
+                        outp[y] = v;
+                }
+            }
+        }
+    }
+}
+
+// outptr[j] = (p0[j] + p1r[-j] + p2r[-j] + p3[j]) * scale, null pointers are skipped
+static void merge_row4(const float* p0, const float* p1r, const float* p2r, const float* p3, float* outptr, int n, float scale)
+{
+    int j = 0;
+#if __AVX2__
+    __m256 _scale = _mm256_set1_ps(scale);
+    for (; j + 7 < n; j += 8)
+    {
+        __m256 _v = _mm256_setzero_ps();
+        if (p0) _v = _mm256_add_ps(_v, _mm256_loadu_ps(p0 + j));
+        if (p1r) _v = _mm256_add_ps(_v, loadu_reversed_ps(p1r - j));
+        if (p2r) _v = _mm256_add_ps(_v, loadu_reversed_ps(p2r - j));
+        if (p3) _v = _mm256_add_ps(_v, _mm256_loadu_ps(p3 + j));
+        _mm256_storeu_ps(outptr + j, _mm256_mul_ps(_v, _scale));
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    for (; j + 3 < n; j += 4)
+    {
+        float32x4_t _v = vdupq_n_f32(0.f);
+        if (p0) _v = vaddq_f32(_v, vld1q_f32(p0 + j));
+        if (p1r) _v = vaddq_f32(_v, vld1q_reversed_f32(p1r - j));
+        if (p2r) _v = vaddq_f32(_v, vld1q_reversed_f32(p2r - j));
+        if (p3) _v = vaddq_f32(_v, vld1q_f32(p3 + j));
+        vst1q_f32(outptr + j, vmulq_n_f32(_v, scale));
+    }
+#endif // __ARM_NEON
+    for (; j < n; j++)
+    {
+        float v = 0.f;
+        if (p0) v += p0[j];
+        if (p1r) v += p1r[-j];
+        if (p2r) v += p2r[-j];
+        if (p3) v += p3[j];
+        outptr[j] = v * scale;
+    }
+}
+
+static void tta_transform(const float* ptr, int w, int h, float* const* outptrs)
+{
+    for (int i = 0; i < h; i++)
+    {
+        const float* p = ptr + (size_t)i * w;
+
+        if (outptrs[1])
+            reverse_copy(p, outptrs[1] + (size_t)i * w, w);
+        if (outptrs[2])
+            reverse_copy(p, outptrs[2] + (size_t)(h - 1 - i) * w, w);
+        if (outptrs[3])
+            memcpy(outptrs[3] + (size_t)(h - 1 - i) * w, p, w * sizeof(float));
+    }
+
+    // one blocked transpose into the first transposed output, the others are row flips of it
+    int base = 4;
+    while (base < 8 && !outptrs[base])
+        base++;
+
+    if (base == 8)
+        return;
+
+    float* tptr = outptrs[base];
+
+    transpose_plane<false>(ptr, w, tptr, h, w, h, 1.f);
+
+    for (int i = 0; i < w; i++)
+    {
+        const float* p = tptr + (size_t)i * h;
+
+        if (base != 5 && outptrs[5])
+            reverse_copy(p, outptrs[5] + (size_t)i * h, h);
+        if (base != 6 && outptrs[6])
+            reverse_copy(p, outptrs[6] + (size_t)(w - 1 - i) * h, h);
+        if (base != 7 && outptrs[7])
+            memcpy(outptrs[7] + (size_t)(w - 1 - i) * h, p, h * sizeof(float));
+    }
+
+    if (base == 5 || base == 6)
+    {
+        for (int i = 0; i < w; i++)
+        {
+            reverse_inplace(tptr + (size_t)i * h, h);
+        }
+    }
+    if (base == 6 || base == 7)
+    {
+        for (int i = 0; i < w / 2; i++)
+        {
+            swap_rows(tptr + (size_t)i * h, tptr + (size_t)(w - 1 - i) * h, h);
+        }
+    }
+}
+
+static void tta_merge(const float* const* ptrs, int w, int h, float* outptr, int outw, int outh, float* tmpptr)
+{
+    int count = 0;
+    for (int k = 0; k < 8; k++)
+    {
+        if (ptrs[k])
+            count++;
+    }
+
+    const float norm = 1.f / count;
+    const bool has_transposed = ptrs[4] || ptrs[5] || ptrs[6] || ptrs[7];
+
+    for (int i = 0; i < outh; i++)
+    {
+        const float* p0 = ptrs[0] ? ptrs[0] + (size_t)i * w : 0;
+        const float* p1r = ptrs[1] ? ptrs[1] + (size_t)i * w + w - 1 : 0;
+        const float* p2r = ptrs[2] ? ptrs[2] + (size_t)(h - 1 - i) * w + w - 1 : 0;
+        const float* p3 = ptrs[3] ? ptrs[3] + (size_t)(h - 1 - i) * w : 0;
+
+        merge_row4(p0, p1r, p2r, p3, outptr + (size_t)i * outw, outw, has_transposed ? 1.f : norm);
+    }
+
+    if (!has_transposed)
+        return;
+
+    // sum the transposed ones row by row in their own layout, then add with one blocked transpose
+    for (int i = 0; i < outw; i++)
+    {
+        const float* p4 = ptrs[4] ? ptrs[4] + (size_t)i * h : 0;
+        const float* p5r = ptrs[5] ? ptrs[5] + (size_t)i * h + h - 1 : 0;
+        const float* p6r = ptrs[6] ? ptrs[6] + (size_t)(w - 1 - i) * h + h - 1 : 0;
+        const float* p7 = ptrs[7] ? ptrs[7] + (size_t)(w - 1 - i) * h : 0;
+
+        merge_row4(p4, p5r, p6r, p7, tmpptr + (size_t)i * outh, outh, 1.f);
+    }
+
+    transpose_plane<true>(tmpptr, outh, outptr, outw, outh, outw, norm);
+}
+
+// sum of min(|a - b| * 255, 8) over n values, b is read backwards from pb when reversed
+static float diff_row(const float* pa, const float* pb, int n, bool reversed)
+{
+    float sum = 0.f;
+
+    int j = 0;
+#if __AVX2__
+    __m256 _sum = _mm256_setzero_ps();
+    __m256 _signmask = _mm256_set1_ps(-0.f);
+    __m256 _scale = _mm256_set1_ps(255.f);
+    __m256 _limit = _mm256_set1_ps(8.f);
+    for (; j + 7 < n; j += 8)
+    {
+        __m256 _b = reversed ? loadu_reversed_ps(pb - j) : _mm256_loadu_ps(pb + j);
+        __m256 _d = _mm256_andnot_ps(_signmask, _mm256_sub_ps(_mm256_loadu_ps(pa + j), _b));
+        _sum = _mm256_add_ps(_sum, _mm256_min_ps(_mm256_mul_ps(_d, _scale), _limit));
+    }
+    {
+        __m128 _s = _mm_add_ps(_mm256_castps256_ps128(_sum), _mm256_extractf128_ps(_sum, 1));
+        _s = _mm_add_ps(_s, _mm_movehl_ps(_s, _s));
+        _s = _mm_add_ss(_s, _mm_shuffle_ps(_s, _s, 1));
+        sum += _mm_cvtss_f32(_s);
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    float32x4_t _sum = vdupq_n_f32(0.f);
+    for (; j + 3 < n; j += 4)
+    {
+        float32x4_t _b = reversed ? vld1q_reversed_f32(pb - j) : vld1q_f32(pb + j);
+        float32x4_t _d = vabdq_f32(vld1q_f32(pa + j), _b);
+        _sum = vaddq_f32(_sum, vminq_f32(vmulq_n_f32(_d, 255.f), vdupq_n_f32(8.f)));
+    }
+    {
+        float32x2_t _s = vadd_f32(vget_low_f32(_sum), vget_high_f32(_sum));
+        sum += vget_lane_f32(vpadd_f32(_s, _s), 0);
+    }
+#endif // __ARM_NEON
+    for (; j < n; j++)
+    {
+        float d = pa[j] - (reversed ? pb[-j] : pb[j]);
+        d = (d < 0.f ? -d : d) * 255.f;
+        sum += d < 8.f ? d : 8.f;
+    }
+
+    return sum;
+}
+
+static double tta_diff(const float* ptr0, const float* ptrk, int k, int w, int h, int outw, int outh)
+{
+    double sum = 0.0;
+
+    for (int i = 0; i < outh; i++)
+    {
+        const float* p0 = ptr0 + (size_t)i * w;
+
+        if (k == 1)
+            sum += diff_row(p0, ptrk + (size_t)i * w + w - 1, outw, true);
+        else if (k == 2)
+            sum += diff_row(p0, ptrk + (size_t)(h - 1 - i) * w + w - 1, outw, true);
+        else
+            sum += diff_row(p0, ptrk + (size_t)(h - 1 - i) * w, outw, false);
+    }
+
+    return sum;
+}
+
+} // namespace
+
+#endif // WAIFU2X_CPU_KERNEL_H
@@ -0,0 +1,127 @@
+// waifu2x implemented with ncnn library
+
+#include "waifu2x_tile_cache.h"
+
+#include <string.h>
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+TileHasher::TileHasher()
+{
+    h0 = 0x9e3779b97f4a7c15ULL;
+    h1 = 0x6a09e667f3bcc909ULL;
+    length = 0;
+}
+
+void TileHasher::update(const void* data, size_t size)
+{
+    // two murmur3 style lanes over 8 byte words, the tail is zero padded
+    const unsigned char* ptr = (const unsigned char*)data;
+
+    length += size;
+
+    while (size > 0)
+    {
+        uint64_t v = 0;
+        const size_t n = size < 8 ? size : 8;
+        memcpy(&v, ptr, n);
+
+        h0 ^= rotl64(v * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+        h0 = rotl64(h0, 27) * 5 + 0x52dce729;
+
+        h1 ^= rotl64(v * 0x4cf5ad432745937fULL, 33) * 0x87c37b91114253d5ULL;
+        h1 = rotl64(h1, 31) * 5 + 0x38495ab5;
+
+        ptr += n;
+        size -= n;
+    }
+}
+
+void TileHasher::update(int v)
+{
+    update(&v, sizeof(v));
+}
+
+TileCacheKey TileHasher::key() const
+{
+    TileCacheKey key;
+    key.h0 = fmix64(h0 ^ length);
+    key.h1 = fmix64(h1 + length);
+    return key;
+}
+
+TileCache::TileCache(size_t _capacity)
+{
+    capacity = _capacity;
+    size = 0;
+    hits = 0;
+    misses = 0;
+}
+
+bool TileCache::get(const TileCacheKey& key, std::vector<unsigned char>& data)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    std::map<TileCacheKey, entry_list::iterator>::iterator it = index.find(key);
+    if (it == index.end())
+    {
+        misses++;
+        return false;
+    }
+
+    hits++;
+
+    // move to front
+    entries.splice(entries.begin(), entries, it->second);
+
+    data = it->second->second;
+    return true;
+}
+
+void TileCache::put(const TileCacheKey& key, const std::vector<unsigned char>& data)
+{
+    if (data.size() > capacity)
+        return;
+
+    ncnn::MutexLockGuard guard(lock);
+
+    // another thread computed the same tile meanwhile
+    if (index.find(key) != index.end())
+        return;
+
+    while (size + data.size() > capacity)
+    {
+        size -= entries.back().second.size();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+
+    entries.push_front(std::make_pair(key, data));
+    index[key] = entries.begin();
+    size += data.size();
+}
+
+size_t TileCache::hit_count() const
+{
+    ncnn::MutexLockGuard guard(lock);
+    return hits;
+}
+
+size_t TileCache::miss_count() const
+{
+    ncnn::MutexLockGuard guard(lock);
+    return misses;
+}
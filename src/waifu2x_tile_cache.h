@@ -0,0 +1,74 @@
+// waifu2x implemented with ncnn library
+
+#ifndef WAIFU2X_TILE_CACHE_H
+#define WAIFU2X_TILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <vector>
+
+// ncnn
+#include "platform.h"
+
+class TileCacheKey
+{
+public:
+    uint64_t h0;
+    uint64_t h1;
+
+    bool operator<(const TileCacheKey& rhs) const
+    {
+        return h0 < rhs.h0 || (h0 == rhs.h0 && h1 < rhs.h1);
+    }
+};
+
+// 128bit content hash built from pixel rows and parameters
+class TileHasher
+{
+public:
+    TileHasher();
+
+    void update(const void* data, size_t size);
+    void update(int v);
+
+    TileCacheKey key() const;
+
+private:
+    uint64_t h0;
+    uint64_t h1;
+    uint64_t length;
+};
+
+// size bounded lru of output tiles, shared by all proc threads
+class TileCache
+{
+public:
+    TileCache(size_t capacity);
+
+    // copy the tile out when cached
+    bool get(const TileCacheKey& key, std::vector<unsigned char>& data);
+
+    void put(const TileCacheKey& key, const std::vector<unsigned char>& data);
+
+    size_t hit_count() const;
+    size_t miss_count() const;
+
+private:
+    typedef std::list<std::pair<TileCacheKey, std::vector<unsigned char> > > entry_list;
+
+    size_t capacity;
+    size_t size;
+
+    // most recently used first
+    entry_list entries;
+    std::map<TileCacheKey, entry_list::iterator> index;
+
+    size_t hits;
+    size_t misses;
+
+    mutable ncnn::Mutex lock;
+};
+
+#endif // WAIFU2X_TILE_CACHE_H
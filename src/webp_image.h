@@ -5,9 +5,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "webp/decode.h"
+
+// ncnn
+#include "allocator.h"
 #include "webp/encode.h"
 
-unsigned char* webp_load(const unsigned char* buffer, int len, int* w, int* h, int* c)
+// pixel data comes from allocator when given, malloc otherwise
+unsigned char* webp_load(const unsigned char* buffer, int len, int* w, int* h, int* c, ncnn::Allocator* allocator = 0)
 {
     unsigned char* pixeldata = 0;
 
@@ -21,7 +25,10 @@ unsigned char* webp_load(const unsigned char* buffer, int len, int* w, int* h, i
     int height = config.input.height;
     int channels = config.input.has_alpha ? 4 : 3;
 
-    pixeldata = (unsigned char*)malloc(width * height * channels);
+    const size_t size = (size_t)width * height * channels;
+    pixeldata = (unsigned char*)(allocator ? allocator->fastMalloc(size) : malloc(size));
+    if (!pixeldata)
+        return NULL;
 
 #if _WIN32
     config.output.colorspace = channels == 4 ? MODE_BGRA : MODE_BGR;
@@ -30,13 +37,16 @@ unsigned char* webp_load(const unsigned char* buffer, int len, int* w, int* h, i
 #endif
 
     config.output.u.RGBA.stride = width * channels;
-    config.output.u.RGBA.size = width * height * channels;
+    config.output.u.RGBA.size = size;
     config.output.u.RGBA.rgba = pixeldata;
     config.output.is_external_memory = 1;
 
     if (WebPDecode(buffer, len, &config) != VP8_STATUS_OK)
     {
-        free(pixeldata);
+        if (allocator)
+            allocator->fastFree(pixeldata);
+        else
+            free(pixeldata);
         return NULL;
     }
 
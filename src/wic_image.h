@@ -4,7 +4,11 @@
 // image decoder and encoder with WIC
 #include <wincodec.h>
 
-unsigned char* wic_decode_image(const wchar_t* filepath, int* w, int* h, int* c)
+// ncnn
+#include "allocator.h"
+
+// pixel data comes from allocator when given, malloc otherwise
+unsigned char* wic_decode_image(const wchar_t* filepath, int* w, int* h, int* c, ncnn::Allocator* allocator = 0)
 {
     IWICImagingFactory* factory = 0;
     IWICBitmapDecoder* decoder = 0;
@@ -83,7 +87,7 @@ unsigned char* wic_decode_image(const wchar_t* filepath, int* w, int* h, int* c)
     if (lock->GetStride((UINT*)&stride))
         goto RETURN;
 
-    bgrdata = (unsigned char*)malloc(width * height * channels);
+    bgrdata = (unsigned char*)(allocator ? allocator->fastMalloc((size_t)width * height * channels) : malloc((size_t)width * height * channels));
     if (!bgrdata)
         goto RETURN;
 